@@ -191,9 +191,7 @@ public:
 
     /// Find a structure record by id number.
     ///
-    static StructSpec *structspec (int id) {
-        return id ? struct_list()[id].get() : NULL;
-    }
+    static StructSpec *structspec (int id);
 
     /// Find a structure index by name, or return 0 if not found.
     /// If 'add' is true, add the struct if not already found.
@@ -205,10 +203,11 @@ public:
 
     /// Return a pointer to the last structure added to the end of the
     /// structure list.
-    static StructSpec *last_struct () { return struct_list().back().get(); }
+    static StructSpec *last_struct ();
 
-    /// Return a reference to the structure list.
-    ///
+    /// Return a reference to the structure list.  Unlike the methods
+    /// above, this isn't safe while other threads may be adding
+    /// structures (as when loading shaders), so it's only for oslc.
     static std::vector<shared_ptr<StructSpec> > & struct_list ();
 
     /// Is this an array (either a simple array, or an array of structs)?
@@ -444,7 +443,7 @@ public:
           m_name(name), m_typespec(datatype), m_symtype(symtype),
           m_has_derivs(false), m_const_initializer(false),
           m_connected(false), m_connected_down(false),
-          m_initialized(false), m_lockgeom(false),
+          m_initialized(false), m_lockgeom(false), m_interactive(false),
           m_valuesource(DefaultVal), m_fieldid(-1),
           m_scope(0), m_dataoffset(-1), 
           m_node(declaration_node), m_alias(NULL),
@@ -634,6 +633,11 @@ public:
     bool lockgeom () const { return m_lockgeom; }
     void lockgeom (bool lock) { m_lockgeom = lock; }
 
+    /// Is this a param whose value the renderer may change after the
+    /// shader is compiled (so it must never be folded into the code)?
+    bool interactive () const { return m_interactive; }
+    void interactive (bool i) { m_interactive = i; }
+
     bool is_constant () const { return symtype() == SymTypeConst; }
 
 protected:
@@ -649,6 +653,7 @@ protected:
     unsigned m_connected_down:1;///< Connected to a later/downtream layer
     unsigned m_initialized:1;   ///< If a param, has it been initialized?
     unsigned m_lockgeom:1;      ///< Is the param not overridden by geom?
+    unsigned m_interactive:1;   ///< May the param change after compiling?
     char m_valuesource;         ///< Where did the value come from?
     short m_fieldid;            ///< Struct field of this var (or -1)
     int m_scope;                ///< Scope where this symbol was declared
@@ -140,6 +140,24 @@ public:
     ///
     virtual bool Parameter (const char *name, TypeDesc t, const void *val)
         { return true; }
+
+    /// Set a parameter of the next shader, one that may be changed
+    /// later with ReParameter.  Its value is never folded into the
+    /// optimized code, so changing it needs no recompile (but the code
+    /// is a little slower than if it were an ordinary parameter).
+    virtual bool InteractiveParameter (const char *name, TypeDesc t,
+                                       const void *val)
+        { return true; }
+
+    /// Declare that the named userdata has the given value everywhere
+    /// on the objects that use the current attribute state.  Params
+    /// that would otherwise get their values from get_userdata as they
+    /// run (those without lockgeom) are instead set to the value when
+    /// the state's groups are optimized, so it can be folded into the
+    /// code.
+    virtual bool ConstantUserdata (const char *name, TypeDesc t,
+                                   const void *val)
+        { return true; }
 #if 0
     virtual bool Parameter (const char *name, int val) {
         Parameter (name, TypeDesc::IntType, &val);
@@ -183,6 +201,26 @@ public:
     /// specified.
     virtual void clear_state () = 0;
 
+    /// Optimize and compile all the shader groups of the attribute
+    /// state right away, rather than when they are first executed, and
+    /// save the fully optimized code in the JIT cache so that later
+    /// runs can load it instead of compiling it again.  This requires
+    /// the "cachedir" attribute.  Return true if every group is now in
+    /// the cache.
+    virtual bool bake (ShadingAttribStateRef &attribstate) = 0;
+
+    /// Change the value of a parameter that was set with
+    /// InteractiveParameter, in the named layer of the attribute
+    /// state's shader groups.  Shading that starts afterwards uses the
+    /// new value, without the groups being optimized or compiled again.
+    /// The value is changed in place, so this must not be called while
+    /// any thread is shading with the attribute state.  Strings are
+    /// passed as char*'s, as with Parameter.  Return false if there is
+    /// no such interactive parameter, or the type doesn't match.
+    virtual bool ReParameter (ShadingAttribStateRef &attribstate,
+                              const char *layername, const char *paramname,
+                              TypeDesc t, const void *val) = 0;
+
     /// Return the statistics output as a huge string.
     ///
     virtual std::string getstats (int level=1) const = 0;
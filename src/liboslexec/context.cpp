@@ -50,7 +50,9 @@ namespace pvt {   // OSL::pvt
 
 ShadingContext::ShadingContext (ShadingSystemImpl &shadingsys) 
     : m_shadingsys(shadingsys), m_renderer(m_shadingsys.renderer()),
-      m_attribs(NULL), m_dictionary(NULL)
+      m_attribs(NULL), m_group(NULL), m_sg(NULL), m_npoints(0), m_groupdata_size(0),
+      m_compile_pending(false), m_counted_points(0), m_jit_epoch(0),
+      m_dictionary(NULL)
 {
     m_shadingsys.m_stat_contexts += 1;
 }
@@ -60,6 +62,7 @@ ShadingContext::ShadingContext (ShadingSystemImpl &shadingsys)
 ShadingContext::~ShadingContext ()
 {
     m_shadingsys.m_stat_contexts -= 1;
+    flush_execution_count ();
     for (RegexMap::iterator it = m_regex_map.begin(); it != m_regex_map.end(); ++it) {
       delete it->second;
     }
@@ -69,36 +72,89 @@ ShadingContext::~ShadingContext ()
 
 
 bool
-ShadingContext::prepare_execution (ShaderUse use, ShadingAttribState &sas)
+ShadingContext::prepare_execution (ShaderUse use, ShadingAttribState &sas,
+                                   int npoints, int raytype, bool derivs)
 {
     DASSERT (use == ShadUseSurface);  // FIXME
 
     m_curuse = use;
     m_attribs = &sas;
+    m_group = NULL;
     m_closures_allotted = 0;
+    m_sg = NULL;
+    m_npoints = 0;
+    m_compile_pending = false;
 
     // Optimize if we haven't already
-    ShaderGroup &sgroup (sas.shadergroup (use));
-    if (sgroup.nlayers()) {
-        sgroup.start_running ();
+    ShaderGroup *group = &sas.shadergroup (use);
+    if (group->nlayers()) {
+        ShaderGroup &sgroup (*group);
         if (! sgroup.optimized()) {
-            shadingsys().optimize_group (sas, sgroup);
+            if (shadingsys().async_compile()) {
+                // Don't stall this thread -- let the compile threads
+                // handle it, and tell the caller to come back later.
+                shadingsys().optimize_group_async (sas, sgroup);
+                if (! sgroup.optimized()) {
+                    m_compile_pending = true;
+                    shadingsys().m_stat_deferred_executions += npoints;
+                    return false;
+                }
+            } else {
+                shadingsys().optimize_group (sas, sgroup);
+            }
+        }
+        // Run the code specialized for this raytype, or without
+        // derivatives, if there is any
+        if ((raytype >= 0 && shadingsys().raytype_variants()) ||
+              (! derivs && shadingsys().noderivs_variants())) {
+            group = shadingsys().group_variant (sas, sgroup, raytype, derivs);
+            if (group != &sgroup)
+                shadingsys().m_stat_group_variant_points += npoints;
+        }
+        // Once a first-tier group has gotten hot, run its fully
+        // optimized copy instead
+        if (ShaderGroup *hot = group->tiered_up ())
+            group = hot;
+        // Count the points toward recompiling the group, but only while
+        // that could still happen.  They add up in this context and go
+        // to the group's count (which we hold on to, rather than the
+        // group, which may not outlive the call) in batches, so threads
+        // don't all fight over it on every call.
+        int threshold = shadingsys().tier_threshold();
+        if (threshold > 0 && group->tier() == 0) {
+            if (m_counted != group->execution_count()) {
+                flush_execution_count ();
+                m_counted = group->execution_count();
+            }
+            m_counted_points += npoints;
+            if (*m_counted + m_counted_points >= threshold) {
+                flush_execution_count ();
+                shadingsys().request_recompile (*group);
+            } else if (m_counted_points >= 1024) {
+                flush_execution_count ();
+            }
         }
     } else {
        // empty shader - nothing to do!
        return false; 
     }
+    if (! group->llvm_compiled_version())
+        return false;   // couldn't be compiled; the error was reported
+
+    m_group = group;
 
     // Allocate enough space on the heap
-    size_t heap_size_needed = sgroup.llvm_groupdata_size();
+    m_groupdata_size = group->llvm_groupdata_size();
+    size_t heap_size_needed = m_groupdata_size * npoints;
     if (heap_size_needed > m_heap.size()) {
         if (shadingsys().debug())
             shadingsys().info ("  ShadingContext %p growing heap to %llu",
                                this, (unsigned long long) heap_size_needed);
         m_heap.resize (heap_size_needed);
     }
-    // Zero out the heap memory we will be using
-    if (shadingsys().m_clearmemory)
+    // Zero out the heap memory we will be using, unless the code will
+    // zero just the parts that need it.
+    if (shadingsys().m_clearmemory && ! group->inits_groupdata())
         memset (&m_heap[0], 0, heap_size_needed);
 
     // Set up closure storage
@@ -114,12 +170,12 @@ ShadingContext::prepare_execution (ShaderUse use, ShadingAttribState &sas)
 
 void
 ShadingContext::execute (ShaderUse use, ShadingAttribState &sas,
-                         ShaderGlobals &ssg)
+                         ShaderGlobals &ssg, bool derivs)
 {
-    if (! prepare_execution (use, sas))
+    if (! prepare_execution (use, sas, 1, ssg.raytype, derivs))
         return;
 
-    ShaderGroup &sgroup (m_attribs->shadergroup (use));
+    ShaderGroup &sgroup (*m_group);
     DASSERT (sgroup.llvm_compiled_version());
     DASSERT (sgroup.llvm_groupdata_size() <= m_heap.size());
     ssg.context = this;
@@ -130,10 +186,69 @@ ShadingContext::execute (ShaderUse use, ShadingAttribState &sas,
 
 
 
+void
+ShadingContext::execute_batch (ShaderUse use, ShadingAttribState &sas,
+                               ShaderGlobals *ssg, int npoints, bool derivs)
+{
+    if (bind (use, sas, ssg, npoints, derivs))
+        execute_llvm (use);
+}
+
+
+
+bool
+ShadingContext::bind (ShaderUse use, ShadingAttribState &sas,
+                      ShaderGlobals *ssg, int npoints, bool derivs)
+{
+    if (npoints < 1)
+        return false;
+    // Specialize for the raytype only if all the points share it
+    int raytype = ssg[0].raytype;
+    for (int i = 1;  i < npoints && raytype >= 0;  ++i)
+        if (ssg[i].raytype != raytype)
+            raytype = -1;
+    if (! prepare_execution (use, sas, npoints, raytype, derivs))
+        return false;
+    m_sg = ssg;
+    m_npoints = npoints;
+    return true;
+}
+
+
+
+void
+ShadingContext::execute_llvm (ShaderUse use, Runflag *rf, int *ind, int nind)
+{
+    if (! m_npoints)
+        return;   // not bound, or nothing to run
+    DASSERT (use == m_curuse);
+    ShaderGroup &sgroup (*m_group);
+    DASSERT (sgroup.llvm_compiled_version());
+    DASSERT (m_groupdata_size * m_npoints <= m_heap.size());
+    RunLLVMGroupFunc run_func = sgroup.llvm_compiled_version();
+    if (ind) {
+        for (int i = 0;  i < nind;  ++i) {
+            DASSERT (ind[i] >= 0 && ind[i] < m_npoints);
+            run_point (run_func, ind[i]);
+        }
+    } else if (rf) {
+        for (int i = 0;  i < m_npoints;  ++i)
+            if (rf[i])
+                run_point (run_func, i);
+    } else {
+        for (int i = 0;  i < m_npoints;  ++i)
+            run_point (run_func, i);
+    }
+}
+
+
+
 Symbol *
 ShadingContext::symbol (ShaderUse use, ustring name)
 {
-    ShaderGroup &sgroup (attribs()->shadergroup (use));
+    // The symbols of the raytype variant we ran, if we did
+    ShaderGroup &sgroup (m_group && use == m_curuse ? *m_group
+                         : attribs()->shadergroup (use));
     int nlayers = sgroup.nlayers ();
     if (sgroup.llvm_compiled_version()) {
         for (int layer = nlayers-1;  layer >= 0;  --layer) {
@@ -150,7 +265,8 @@ ShadingContext::symbol (ShaderUse use, ustring name)
 void *
 ShadingContext::symbol_data (Symbol &sym, int gridpoint)
 {
-    ShaderGroup &sgroup (attribs()->shadergroup ((ShaderUse)m_curuse));
+    ShaderGroup &sgroup (m_group ? *m_group
+                         : attribs()->shadergroup ((ShaderUse)m_curuse));
     if (sgroup.llvm_compiled_version()) {
         size_t offset = sgroup.llvm_groupdata_size() * gridpoint;
         offset += sym.dataoffset();
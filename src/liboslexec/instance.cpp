@@ -27,6 +27,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <vector>
+#include <algorithm>
 #include <string>
 #include <cstdio>
 
@@ -53,6 +54,10 @@ using OIIO::ParamValueList;
 #endif
 
 
+static int next_instance_id = 0; // We can statically init an int, not an atomic
+
+
+
 ShaderInstance::ShaderInstance (ShaderMaster::ref master,
                                 const char *layername) 
     : m_master(master),
@@ -65,8 +70,7 @@ ShaderInstance::ShaderInstance (ShaderMaster::ref master,
       m_maincodebegin(m_master->m_maincodebegin),
       m_maincodeend(m_master->m_maincodeend)
 {
-    static int next_id = 0; // We can statically init an int, not an atomic
-    m_id = ++(*(atomic_int *)&next_id);
+    m_id = ++(*(atomic_int *)&next_instance_id);
     shadingsys().m_stat_instances += 1;
 
     // Copy just the part of the symbol table that includes the params.
@@ -105,6 +109,47 @@ ShaderInstance::ShaderInstance (ShaderMaster::ref master,
 
 
 
+ShaderInstance::ShaderInstance (const ShaderInstance &inst)
+    : m_master(inst.m_master), m_instsymbols(inst.m_instsymbols),
+      m_layername(inst.m_layername), m_iparams(inst.m_iparams),
+      m_fparams(inst.m_fparams), m_sparams(inst.m_sparams),
+      m_interactive_params(inst.m_interactive_params),
+      m_writes_globals(inst.m_writes_globals),
+      m_run_lazily(inst.m_run_lazily),
+      m_outgoing_connections(inst.m_outgoing_connections),
+      m_connections(inst.m_connections),
+      m_firstparam(inst.m_firstparam), m_lastparam(inst.m_lastparam),
+      m_maincodebegin(inst.m_maincodebegin),
+      m_maincodeend(inst.m_maincodeend),
+      m_Psym(inst.m_Psym), m_Nsym(inst.m_Nsym)
+{
+    ASSERT (inst.m_instops.empty() && "can only copy unoptimized instances");
+    m_id = ++(*(atomic_int *)&next_instance_id);
+    shadingsys().m_stat_instances += 1;
+
+    // Instance parameter values must point to our own copies
+    bind_instance_values ();
+
+    // Adjust statistics (to balance what the destructor subtracts)
+    ShadingSystemImpl &ss (shadingsys());
+    off_t symmem = vectorbytes (m_instsymbols);
+    off_t parammem = vectorbytes (m_iparams)
+        + vectorbytes (m_fparams) + vectorbytes (m_sparams);
+    off_t connectionmem = vectorbytes (m_connections);
+    off_t totalmem = (symmem + parammem + connectionmem +
+                      sizeof(ShaderInstance));
+    {
+        spin_lock lock (ss.m_stat_mutex);
+        ss.m_stat_mem_inst_syms += symmem;
+        ss.m_stat_mem_inst_paramvals += parammem;
+        ss.m_stat_mem_inst_connections += connectionmem;
+        ss.m_stat_mem_inst += totalmem;
+        ss.m_stat_memory += totalmem;
+    }
+}
+
+
+
 ShaderInstance::~ShaderInstance ()
 {
     shadingsys().m_stat_instances -= 1;
@@ -223,6 +268,85 @@ ShaderInstance::parameters (const ParamValueList &params)
 
 
 
+bool
+ShaderInstance::make_interactive (ustring name)
+{
+    Symbol *s = symbol (findparam (name));
+    if (! s || s->symtype() != SymTypeParam ||
+          s->valuesource() != Symbol::InstanceVal)
+        return false;
+    s->interactive (true);
+    m_interactive_params.push_back (name);
+    return true;
+}
+
+
+
+bool
+ShaderInstance::can_fold_userdata (const ParamValue &p) const
+{
+    const Symbol *s = symbol (findparam (p.name()));
+    if (! s || s->lockgeom() || s->interactive() ||
+          s->valuesource() == Symbol::ConnectedVal ||
+          s->typespec().simpletype() != p.type())
+        return false;
+    TypeDesc t = s->typespec().simpletype();
+    return (t.basetype == TypeDesc::INT || t.basetype == TypeDesc::FLOAT ||
+            t.basetype == TypeDesc::STRING);
+}
+
+
+
+bool
+ShaderInstance::fold_userdata (const ParamValue &p)
+{
+    if (! can_fold_userdata (p))
+        return false;
+    // Just as if it had been given as an instance value all along
+    Symbol *s = symbol (findparam (p.name()));
+    TypeDesc t = s->typespec().simpletype();
+    s->step (0);
+    s->valuesource (Symbol::InstanceVal);
+    if (t.basetype == TypeDesc::INT)
+        s->data (&m_iparams[s->dataoffset()]);
+    else if (t.basetype == TypeDesc::FLOAT)
+        s->data (&m_fparams[s->dataoffset()]);
+    else
+        s->data (&m_sparams[s->dataoffset()]);
+    memcpy (s->data(), p.data(), t.size());
+    s->lockgeom (true);
+    return true;
+}
+
+
+
+bool
+ShaderInstance::reparameter (ustring name, TypeDesc t, const void *val)
+{
+    if (std::find (m_interactive_params.begin(), m_interactive_params.end(),
+                   name) == m_interactive_params.end())
+        return false;
+    // Once we're optimized, the param's symbol may be gone (or its
+    // dataoffset may be a group data offset), but its value is still
+    // where the master's symbol says.
+    const Symbol *s = m_master->symbol (m_master->findsymbol (name));
+    if (! s || s->typespec().simpletype() != t)
+        return false;
+    if (t.basetype == TypeDesc::INT)
+        memcpy (&m_iparams[s->dataoffset()], val, t.size());
+    else if (t.basetype == TypeDesc::FLOAT)
+        memcpy (&m_fparams[s->dataoffset()], val, t.size());
+    else if (t.basetype == TypeDesc::STRING) {
+        // The caller passes char*'s, but we hold ustrings
+        for (int i = 0;  i < (int)t.numelements();  ++i)
+            m_sparams[s->dataoffset()+i] = ustring (((const char **)val)[i]);
+    } else
+        return false;
+    return true;
+}
+
+
+
 void
 ShaderInstance::make_symbol_room (size_t moresyms)
 {
@@ -265,6 +389,24 @@ ShaderInstance::add_connection (int srclayer, const ConnectedParam &srccon,
 
 
 
+void
+ShaderInstance::bind_instance_values ()
+{
+    BOOST_FOREACH (Symbol &s, m_instsymbols) {
+        if (s.valuesource() != Symbol::InstanceVal)
+            continue;
+        TypeDesc t = s.typespec().simpletype();
+        if (t.basetype == TypeDesc::INT)
+            s.data (&m_iparams[s.dataoffset()]);
+        else if (t.basetype == TypeDesc::FLOAT)
+            s.data (&m_fparams[s.dataoffset()]);
+        else if (t.basetype == TypeDesc::STRING)
+            s.data (&m_sparams[s.dataoffset()]);
+    }
+}
+
+
+
 void
 ShaderInstance::copy_code_from_master ()
 {
@@ -405,23 +547,87 @@ ShaderInstance::print ()
 
 
 ShaderGroup::ShaderGroup ()
-  : m_llvm_compiled_version(NULL), m_llvm_groupdata_size(0), m_optimized(0), m_does_nothing(false)
+  : m_llvm_compiled_version(NULL), m_llvm_groupdata_size(0), m_optimized(0), m_does_nothing(false),
+    m_inits_groupdata(false), m_compile_queued(false),
+    m_compile_running(false), m_compile_owner(NULL),
+    m_tier(1), m_raytype(-1), m_derivs(true), m_tier_up_ptr(NULL)
 {
-    m_executions = 0;
+    m_executions.reset (new atomic_ll);
+    *m_executions = 0;
 }
 
 
 
 ShaderGroup::ShaderGroup (const ShaderGroup &g)
-  : m_layers(g.m_layers), m_llvm_compiled_version(NULL), m_llvm_groupdata_size(0), m_optimized(0), m_does_nothing(false)
+  : m_layers(g.m_layers), m_llvm_compiled_version(NULL), m_llvm_groupdata_size(0), m_optimized(0), m_does_nothing(false),
+    m_inits_groupdata(false), m_compile_queued(false),
+    m_compile_running(false), m_compile_owner(NULL),
+    m_tier(1), m_raytype(g.m_raytype),
+    m_derivs(g.m_derivs), m_renderer_outputs(g.m_renderer_outputs),
+    m_tier_up_ptr(NULL)
+{
+    m_executions.reset (new atomic_ll);
+    *m_executions = 0;
+}
+
+
+
+void
+ShaderGroup::clear ()
+{
+    if (m_compile_owner)
+        m_compile_owner->cancel_compile (*this);
+    // Nothing new may start running the code; the memory it's in is
+    // retired until threads already running it must be done.
+    m_llvm_compiled_version = NULL;
+    m_layers.clear ();  m_llvm_jit_memory.clear ();
+    m_pristine_layers.clear ();  m_variants.clear ();
+    m_tier_up_ptr = NULL;  m_tier_up.reset ();
+    m_shared_code.reset ();
+    m_optimized = 0;
+    // Contexts still adding to the old count won't affect the new one.
+    m_executions.reset (new atomic_ll);
+    *m_executions = 0;
+}
+
+
+
+bool
+ShaderGroup::interactive () const
+{
+    BOOST_FOREACH (const ShaderInstanceRef &inst, m_layers)
+        if (inst->interactive_params().size())
+            return true;
+    return false;
+}
+
+
+
+bool
+ShaderGroup::reparameter (ustring layername, ustring paramname,
+                          TypeDesc t, const void *val)
 {
-    m_executions = 0;
+    bool found = false;
+    BOOST_FOREACH (ShaderInstanceRef &inst, m_layers)
+        if (inst->layername() == layername)
+            found |= inst->reparameter (paramname, t, val);
+    BOOST_FOREACH (ShaderInstanceRef &inst, m_pristine_layers)
+        if (inst->layername() == layername)
+            inst->reparameter (paramname, t, val);
+    spin_lock lock (m_variants_mutex);
+    BOOST_FOREACH (shared_ptr<ShaderGroup> &v, m_variants)
+        v->reparameter (layername, paramname, t, val);
+    if (m_tier_up)
+        m_tier_up->reparameter (layername, paramname, t, val);
+    return found;
 }
 
 
 
 ShaderGroup::~ShaderGroup ()
 {
+    if (m_compile_owner)
+        m_compile_owner->cancel_compile (*this);
 #if 0
     if (m_layers.size()) {
         ustring name = m_layers.back()->layername();
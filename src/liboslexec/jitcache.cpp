@@ -0,0 +1,684 @@
+/*
+Copyright (c) 2009-2010 Sony Pictures Imageworks Inc., et al.
+All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+* Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+* Neither the name of Sony Pictures Imageworks nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <vector>
+#include <string>
+#include <set>
+#include <cstdio>
+#include <fstream>
+#include <cstddef> // FIXME: OIIO's timer.h depends on NULL being defined and should include this itself
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include <boost/foreach.hpp>
+
+#include <OpenImageIO/strutil.h>
+#include <OpenImageIO/timer.h>
+
+#include "llvm_headers.h"
+
+#include "oslexec_pvt.h"
+#include "runtimeoptimize.h"
+
+/*
+ * The JIT cache
+ *
+ * When the "cachedir" attribute is set, every shader group we compile
+ * is saved to that directory, and a later run (or a later group in the
+ * same run) that would generate identical code just loads it instead of
+ * doing runtime specialization, IR generation and LLVM optimization.
+ *
+ * Each cache entry is a pair of files named by the group's key:
+ *   <key>.bc      the fully optimized LLVM module for the group
+ *   <key>.layout  the group data layout and other per-layer information
+ *                 we'd otherwise only learn by optimizing the group
+ *
+ * We can't save native code -- the JIT has no way to load object code
+ * -- so the cached module is JITed again when it's loaded.  That's only
+ * a small fraction of the total cost of compiling a group.  To make the
+ * saved IR valid in a different process, the code we generate for
+ * cacheable groups doesn't embed any addresses; instead, strings,
+ * closure callbacks, and the renderer are referenced by name (see
+ * llvm_external_ptr) and bound to this process's addresses at JIT time.
+ */
+
+extern int osl_llvm_compiled_ops_size;
+extern char osl_llvm_compiled_ops_block[];
+
+#ifdef OSL_NAMESPACE
+namespace OSL_NAMESPACE {
+#endif
+
+namespace OSL {
+namespace pvt {
+
+#ifdef OIIO_NAMESPACE
+using OIIO::spin_lock;
+using OIIO::Timer;
+#endif
+
+
+// Bump this whenever anything changes about what goes into the key or
+// the cache files, or about the code we generate for a group, that
+// would not otherwise be reflected in the key.
+static const int jitcache_format_version = 1;
+
+
+
+namespace {
+
+/// Accumulate a 128 bit hash (two independently mixed 64 bit FNV-style
+/// streams) of all the things that determine a cache entry.
+class KeyHasher {
+public:
+    KeyHasher () : m_a (14695981039346656037ULL), m_b (0x9e3779b97f4a7c15ULL) { }
+
+    void append (const void *data, size_t len) {
+        const unsigned char *c = (const unsigned char *) data;
+        for (size_t i = 0;  i < len;  ++i) {
+            m_a = (m_a ^ c[i]) * 1099511628211ULL;
+            m_b = (m_b ^ c[i]) * 0xff51afd7ed558ccdULL;
+            m_b ^= m_b >> 29;
+        }
+    }
+
+    template<class T> void operator() (const T &val) {
+        append (&val, sizeof(T));
+    }
+    void operator() (const std::string &s) {
+        (*this) (s.size());
+        append (s.data(), s.size());
+    }
+    void operator() (ustring s) { (*this) (s.string()); }
+    void operator() (const TypeSpec &t) { (*this) (std::string (t.c_str())); }
+    template<class T> void operator() (const std::vector<T> &v) {
+        (*this) (v.size());
+        if (v.size())
+            append (&v[0], v.size() * sizeof(T));
+    }
+    void operator() (const std::vector<ustring> &v) {
+        (*this) (v.size());
+        BOOST_FOREACH (ustring s, v)
+            (*this) (s);
+    }
+
+    void symbol (const Symbol &sym) {
+        (*this) (sym.name());
+        (*this) (sym.typespec());
+        (*this) (int (sym.symtype()));
+        (*this) (int (sym.valuesource()));
+        (*this) (sym.size());
+        (*this) (sym.has_derivs());
+        (*this) (sym.lockgeom());
+        (*this) (sym.interactive());
+        (*this) (sym.connected());
+        (*this) (sym.connected_down());
+        (*this) (sym.fieldid());
+        (*this) (sym.dataoffset());
+        (*this) (sym.initbegin());
+        (*this) (sym.initend());
+    }
+
+    void connected_param (const ConnectedParam &p) {
+        (*this) (p.param);
+        (*this) (p.arrayindex);
+        (*this) (p.channel);
+        (*this) (p.offset);
+        (*this) (p.type);
+    }
+
+    std::string str () const {
+        return Strutil::format ("%016llx%016llx", (unsigned long long) m_a,
+                                (unsigned long long) m_b);
+    }
+
+private:
+    unsigned long long m_a, m_b;
+};
+
+
+
+/// Return a hash of the shadeop library bitcode, so that a rebuilt
+/// liboslexec invalidates anything that may have inlined the old ops.
+static const std::string &
+ops_bitcode_hash ()
+{
+    static spin_mutex mutex;
+    static std::string hash;
+    spin_lock lock (mutex);
+    if (hash.empty()) {
+        KeyHasher h;
+#ifndef OSL_LLVM_NO_BITCODE
+        h.append (osl_llvm_compiled_ops_block, osl_llvm_compiled_ops_size);
+#endif
+        hash = h.str ();
+    }
+    return hash;
+}
+
+
+
+/// The groupdata layout of one layer, as read from a .layout file.
+struct CachedLayer {
+    bool run_lazily, outgoing_connections;
+    std::vector<ustring> params;
+    std::vector<int> offsets;
+    std::vector<int> derivs;
+};
+
+};  // anon namespace
+
+
+
+std::string
+RuntimeOptimizer::jitcache_key () const
+{
+    KeyHasher h;
+    ShadingSystemImpl &ss (shadingsys());
+
+    // What built the code
+    h (jitcache_format_version);
+    h (std::string (OSL_LIBRARY_VERSION_STRING));
+    h (int (sizeof(void *)));
+    h (ops_bitcode_hash ());
+
+    // Options that change the code we generate
+    h (ss.m_optimize);
+    h (ss.m_lazylayers);
+    h (ss.m_lazyglobals);
+    h (ss.m_debugnan);
+    h (ss.m_clearmemory);
+    h (ss.m_clearmemory_partial);
+    h (ss.m_commonspace_synonym);
+    h (ss.m_inline_layers);
+    h (ss.m_raytypes);
+    h (m_group.raytype());
+    h (m_group.derivs());
+    h (m_group.renderer_outputs());
+
+    // The closures, whose ids, layouts and callbacks are baked in
+    const ClosureRegistry &closures (ss.m_closure_registry);
+    h (closures.size());
+    for (size_t id = 0;  id < closures.size();  ++id) {
+        const ClosureRegistry::ClosureEntry *c = closures.get_entry ((int)id);
+        h (c->id);
+        h (c->name);
+        h (c->nformal);
+        h (c->nkeyword);
+        h (c->struct_size);
+        h (c->prepare != NULL);
+        h (c->setup != NULL);
+        h (c->params.size());
+        BOOST_FOREACH (const ClosureParam &p, c->params) {
+            h (p.type);
+            h (p.offset);
+            h (std::string (p.key ? p.key : ""));
+            h (p.field_size);
+        }
+    }
+
+    // Every layer: the master's code and the instance's parameter
+    // values and connections.
+    int nlayers = m_group.nlayers ();
+    h (nlayers);
+    for (int layer = 0;  layer < nlayers;  ++layer) {
+        const ShaderInstance *inst = m_group[layer];
+        const ShaderMaster *master = inst->master ();
+        h (master->m_shadername);
+        h (int (master->m_shadertype));
+        h (master->m_firstparam);
+        h (master->m_lastparam);
+        h (master->m_maincodebegin);
+        h (master->m_maincodeend);
+        h (master->m_ops.size());
+        BOOST_FOREACH (const Opcode &op, master->m_ops) {
+            h (op.opname());
+            h (op.method());
+            h (op.firstarg());
+            h (op.nargs());
+            for (int j = 0;  j < (int)Opcode::max_jumps;  ++j)
+                h (op.jump(j));
+            for (int a = 0;  a < op.nargs();  ++a) {
+                h (op.argread(a));
+                h (op.argwrite(a));
+            }
+            h (op.sourcefile());
+            h (op.sourceline());
+        }
+        h (master->m_args);
+        h (master->m_symbols.size());
+        BOOST_FOREACH (const Symbol &sym, master->m_symbols)
+            h.symbol (sym);
+        h (master->m_idefaults);
+        h (master->m_fdefaults);
+        h (master->m_sdefaults);
+        h (master->m_iconsts);
+        h (master->m_fconsts);
+        h (master->m_sconsts);
+
+        h (inst->layername());
+        h (inst->m_iparams);
+        h (inst->m_fparams);
+        h (inst->m_sparams);
+        h (inst->m_firstparam);
+        h (inst->m_lastparam);
+        h (inst->m_writes_globals);
+        h (inst->m_run_lazily);
+        h (inst->m_outgoing_connections);
+        h (inst->m_instsymbols.size());
+        BOOST_FOREACH (const Symbol &sym, inst->m_instsymbols)
+            h.symbol (sym);
+        h (inst->m_connections.size());
+        BOOST_FOREACH (const Connection &c, inst->m_connections) {
+            h (c.srclayer);
+            h.connected_param (c.src);
+            h.connected_param (c.dst);
+        }
+    }
+
+    return h.str ();
+}
+
+
+
+std::string
+RuntimeOptimizer::specialization_key () const
+{
+    KeyHasher h;
+    ShadingSystemImpl &ss (shadingsys());
+    const ShaderInstance *inst = m_group[m_layer];
+    const ShaderMaster *master = inst->master ();
+
+    // Options that change what optimize_instance does (first-tier
+    // groups are optimized at a lower level than the attribute says)
+    h (optimize ());
+    h (ss.m_commonspace_synonym);
+    h (ss.m_raytypes);
+    h (m_group.raytype());
+    h (m_group.renderer_outputs());
+
+    // The master (which is shared, so its address identifies it for
+    // as long as the memo entry can be looked up) and our own
+    // parameter values.
+    h (master);
+    h (master->m_shadername);
+    h (inst->layername());
+    h (inst->m_iparams);
+    h (inst->m_fparams);
+    h (inst->m_sparams);
+    h (inst->m_run_lazily);
+    h (inst->m_instsymbols.size());
+    BOOST_FOREACH (const Symbol &sym, inst->m_instsymbols)
+        h.symbol (sym);
+
+    // Incoming connections, and the state of the upstream outputs,
+    // whose values may be folded into our code.
+    h (inst->m_connections.size());
+    BOOST_FOREACH (const Connection &c, inst->m_connections) {
+        h.connected_param (c.src);
+        h.connected_param (c.dst);
+        const Symbol *src = m_group[c.srclayer]->symbol (c.src.param);
+        h.symbol (*src);
+        h (src->everused());
+        h (src->has_init_ops());
+        if (src->data() && ! src->typespec().is_closure() &&
+                ! src->typespec().is_structure()) {
+            TypeDesc t = src->typespec().simpletype();
+            if (t.basetype == TypeDesc::STRING) {
+                for (size_t i = 0;  i < t.numelements()*t.aggregate;  ++i)
+                    h (((const ustring *)src->data())[i]);
+            } else {
+                h.append (src->data(), t.size());
+            }
+        }
+    }
+
+    // Which of our outputs later layers use
+    for (int lay = m_layer+1;  lay < m_group.nlayers();  ++lay)
+        BOOST_FOREACH (const Connection &c, m_group[lay]->m_connections)
+            if (c.srclayer == m_layer)
+                h (c.src.param);
+
+    // Messages that earlier layers may have set
+    h (m_unknown_message_sent);
+    h (m_messages_sent);
+
+    return h.str ();
+}
+
+
+
+void *
+RuntimeOptimizer::jitcache_resolve (const std::string &name) const
+{
+    static const std::string str_prefix ("osl$str$");
+    static const std::string prepare_prefix ("osl$prepare$");
+    static const std::string setup_prefix ("osl$setup$");
+
+    if (! name.compare (0, str_prefix.size(), str_prefix))
+        return (void *) ustring (name.substr (str_prefix.size())).c_str();
+    if (name == "osl$renderer")
+        return shadingsys().renderer ();
+    if (! name.compare (0, prepare_prefix.size(), prepare_prefix)) {
+        const ClosureRegistry::ClosureEntry *c =
+            shadingsys().find_closure (ustring (name.substr (prepare_prefix.size())));
+        return c ? (void *) c->prepare : NULL;
+    }
+    if (! name.compare (0, setup_prefix.size(), setup_prefix)) {
+        const ClosureRegistry::ClosureEntry *c =
+            shadingsys().find_closure (ustring (name.substr (setup_prefix.size())));
+        return c ? (void *) c->setup : NULL;
+    }
+    return NULL;
+}
+
+
+
+void
+RuntimeOptimizer::jitcache_store (llvm::Function **funcs, int nfuncs)
+{
+    ShadingSystemImpl &ss (shadingsys());
+    llvm::Module *module = llvm_module ();
+
+    // The module still holds every shadeop from the library.  Discard
+    // everything the group no longer refers to, so that what we save is
+    // small and quick to load.
+    std::set<llvm::Function *> layerfuncs (funcs, funcs+nfuncs);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (llvm::Module::iterator f = module->begin();  f != module->end(); ) {
+            llvm::Function *func = &*f;
+            ++f;
+            if (func->use_empty() && ! layerfuncs.count (func)) {
+                func->eraseFromParent ();
+                changed = true;
+            }
+        }
+        for (llvm::Module::global_iterator g = module->global_begin();
+             g != module->global_end(); ) {
+            llvm::GlobalVariable *gv = &*g;
+            ++g;
+            if (gv->use_empty()) {
+                gv->eraseFromParent ();
+                changed = true;
+            }
+        }
+    }
+
+    // Write to uniquely-named temp files and then rename them into
+    // place, so that other threads or processes sharing the cache never
+    // see a partially written entry.  The layout goes last, since its
+    // presence is what makes an entry visible.
+    static atomic_int tmpcounter;
+    std::string base = ss.cachedir() + "/" + m_jitcache_key;
+    std::string tmp = Strutil::format ("%s.%d.%d.tmp", base.c_str(),
+                                       (int)getpid(), (int)++tmpcounter);
+    std::string tmpbc = tmp + ".bc", tmplayout = tmp + ".layout";
+    {
+        std::string err;
+        llvm::raw_fd_ostream out (tmpbc.c_str(), err,
+                                  llvm::raw_fd_ostream::F_Binary);
+        if (err.size()) {
+            ss.warning ("Could not write JIT cache file %s: %s",
+                        tmpbc.c_str(), err.c_str());
+            return;
+        }
+        llvm::WriteBitcodeToFile (module, out);
+    }
+
+    std::ofstream layout (tmplayout.c_str());
+    layout << "OSLJITCACHE " << jitcache_format_version << "\n";
+    layout << "groupdata " << m_group.llvm_groupdata_size() << "\n";
+    layout << "does_nothing " << (int) m_group.does_nothing() << "\n";
+    layout << "layers " << m_group.nlayers() << "\n";
+    for (int layer = 0;  layer < m_group.nlayers();  ++layer) {
+        ShaderInstance *inst = m_group[layer];
+        std::vector<const Symbol *> params;
+        if (! inst->unused()) {
+            FOREACH_PARAM (const Symbol &sym, inst)
+                if (! sym.typespec().is_structure())
+                    params.push_back (&sym);
+        }
+        layout << "layer " << (int) inst->run_lazily() << ' '
+               << (int) inst->outgoing_connections() << ' '
+               << params.size() << "\n";
+        BOOST_FOREACH (const Symbol *sym, params)
+            layout << sym->name() << ' ' << sym->dataoffset() << ' '
+                   << (int) sym->has_derivs() << "\n";
+    }
+    layout << "entry " << funcs[nfuncs-1]->getName().str() << "\n";
+    layout.close ();
+    if (! layout) {
+        ss.warning ("Could not write JIT cache file %s", tmplayout.c_str());
+        std::remove (tmpbc.c_str());
+        std::remove (tmplayout.c_str());
+        return;
+    }
+
+    if (std::rename (tmpbc.c_str(), (base+".bc").c_str()) != 0 ||
+        std::rename (tmplayout.c_str(), (base+".layout").c_str()) != 0) {
+        ss.warning ("Could not add %s to the JIT cache", base.c_str());
+        std::remove (tmpbc.c_str());
+        std::remove (tmplayout.c_str());
+        return;
+    }
+
+    spin_lock lock (ss.m_stat_mutex);
+    ++ss.m_stat_jitcache_stores;
+}
+
+
+
+bool
+RuntimeOptimizer::jitcache_load ()
+{
+    ShadingSystemImpl &ss (shadingsys());
+    Timer timer;
+    std::string base = ss.cachedir() + "/" + m_jitcache_key;
+    int nlayers = m_group.nlayers ();
+
+    // Read and validate the whole layout before we touch the group
+    std::ifstream layout ((base+".layout").c_str());
+    std::string tag, entryname;
+    int version = 0, does_nothing = 0, ncached = 0;
+    size_t groupdata_size = 0;
+    std::vector<CachedLayer> layers;
+    bool ok = false;
+    if (layout >> tag && tag == "OSLJITCACHE" &&
+            layout >> version && version == jitcache_format_version &&
+            layout >> tag >> groupdata_size && tag == "groupdata" &&
+            layout >> tag >> does_nothing && tag == "does_nothing" &&
+            layout >> tag >> ncached && tag == "layers" &&
+            ncached == nlayers) {
+        ok = true;
+        layers.resize (nlayers);
+        for (int layer = 0;  ok && layer < nlayers;  ++layer) {
+            CachedLayer &cl (layers[layer]);
+            int lazy = 0, outgoing = 0;
+            size_t nparams = 0;
+            ok = (layout >> tag >> lazy >> outgoing >> nparams && tag == "layer");
+            cl.run_lazily = lazy;
+            cl.outgoing_connections = outgoing;
+            for (size_t p = 0;  ok && p < nparams;  ++p) {
+                std::string name;
+                int offset = -1, derivs = 0;
+                ok = (layout >> name >> offset >> derivs &&
+                      m_group[layer]->findparam (ustring(name)) >= 0 &&
+                      offset >= 0 && (size_t)offset < groupdata_size);
+                cl.params.push_back (ustring (name));
+                cl.offsets.push_back (offset);
+                cl.derivs.push_back (derivs);
+            }
+        }
+        ok = ok && (layout >> tag && tag == "entry" && layout >> std::ws &&
+                    std::getline (layout, entryname) && entryname.size());
+    }
+    layout.close ();
+
+    RunLLVMGroupFunc func = NULL;
+    llvm::MemoryBuffer *buf = NULL;
+    if (ok) {
+        std::string err;
+        buf = llvm::MemoryBuffer::getFile ((base+".bc").c_str(), &err);
+    }
+    if (buf) {
+        m_llvm_state = ss.acquire_llvm_state ();
+        bool setup = ss.SetupLLVM (*m_llvm_state, m_stat_opt_locking_time,
+                                   buf);
+        delete buf;
+        llvm::ExecutionEngine *ee = m_llvm_state->exec;
+        llvm::Module *module = m_llvm_state->module;
+        if (setup && ee && module) {
+            // Bind every external name to its address in this process
+            llvm::Function *entry = module->getFunction (entryname);
+            bool resolved = (entry != NULL);
+            for (llvm::Module::global_iterator g = module->global_begin();
+                 g != module->global_end();  ++g) {
+                if (! g->isDeclaration())
+                    continue;
+                void *addr = jitcache_resolve (g->getName().str());
+                if (addr)
+                    ee->addGlobalMapping (&*g, addr);
+                else
+                    resolved = false;
+            }
+            if (resolved)
+                func = llvm_jit_group (entry);
+            LLVMJitLock jit_lock (m_stat_opt_locking_time);
+            delete ee;   // N.B. also destroys the module
+        } else {
+            LLVMJitLock jit_lock (m_stat_opt_locking_time);
+            delete ee;
+            delete module;
+        }
+        m_llvm_state->exec = NULL;
+        m_llvm_state->module = NULL;
+        ss.release_llvm_state (m_llvm_state);
+        m_llvm_state = NULL;
+    }
+
+    if (! func) {
+        spin_lock lock (ss.m_stat_mutex);
+        ++ss.m_stat_jitcache_misses;
+        return false;
+    }
+
+    // Leave the instances as optimize_group would have: unused layers
+    // have no code, and the others have just their params that live in
+    // the group data, at the offsets the cached code uses.
+    for (int layer = 0;  layer < nlayers;  ++layer) {
+        set_inst (layer);
+        const CachedLayer &cl (layers[layer]);
+        inst()->run_lazily (cl.run_lazily);
+        inst()->outgoing_connections (cl.outgoing_connections);
+        if (inst()->unused()) {
+            discard_instance_code ();
+            continue;
+        }
+        SymbolVec syms (cl.params.size());
+        for (size_t p = 0;  p < cl.params.size();  ++p) {
+            syms[p] = *inst()->symbol (inst()->findparam (cl.params[p]));
+            syms[p].dataoffset (cl.offsets[p]);
+            syms[p].has_derivs (cl.derivs[p]);
+        }
+        off_t oldmem = vectorbytes (inst()->symbols());
+        std::swap (inst()->symbols(), syms);
+        off_t newmem = vectorbytes (inst()->symbols());
+        inst()->m_firstparam = 0;
+        inst()->m_lastparam = (int) cl.params.size();
+        inst()->m_Psym = inst()->findsymbol (Strings::P);
+        inst()->m_Nsym = inst()->findsymbol (Strings::N);
+        {
+            spin_lock lock (ss.m_stat_mutex);
+            ss.m_stat_mem_inst_syms += newmem - oldmem;
+            ss.m_stat_mem_inst += newmem - oldmem;
+            ss.m_stat_memory += newmem - oldmem;
+        }
+    }
+
+    m_group.llvm_groupdata_size (groupdata_size);
+    m_group.does_nothing (does_nothing != 0);
+    // Both are part of the key
+    m_group.inits_groupdata (ss.m_clearmemory && ss.m_clearmemory_partial);
+    m_group.llvm_compiled_version (func);
+
+    double t = timer();
+    ss.info ("Loaded shader group %s from the JIT cache (%1.2fs)",
+             m_jitcache_key.c_str(), t);
+    spin_lock lock (ss.m_stat_mutex);
+    ++ss.m_stat_jitcache_hits;
+    ss.m_stat_jitcache_load_time += t;
+    return true;
+}
+
+
+
+bool
+ShadingSystemImpl::bake (ShadingAttribStateRef &attribstate)
+{
+    if (m_cachedir.empty()) {
+        error ("Can't bake shader groups without a \"cachedir\"");
+        return false;
+    }
+    bool ok = true;
+    for (int use = 0;  use < (int)ShadUseLast;  ++use) {
+        ShaderGroup &group (attribstate->shadergroup ((ShaderUse)use));
+        if (group.nlayers() == 0)
+            continue;
+        // Quick first-tier code is never cached, so go straight on to
+        // the fully optimized code that a render would end up with.
+        optimize_group (*attribstate, group);
+        if (group.tier() == 0)
+            recompile_group (group, true);
+        // The layout file is written last, so if it's there, so is
+        // the rest of the entry.
+        std::string layout = m_cachedir + "/" + group.jitcache_key() + ".layout";
+        if (! std::ifstream (layout.c_str())) {
+            error ("Could not bake %s shader group (%d layers) to %s",
+                   shaderusename ((ShaderUse)use), group.nlayers(),
+                   m_cachedir.c_str());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+
+
+}; // namespace pvt
+}; // namespace OSL
+
+#ifdef OSL_NAMESPACE
+}; // end namespace OSL_NAMESPACE
+#endif
@@ -26,9 +26,18 @@ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
 #include <cstddef> // FIXME: OIIO's timer.h depends on NULL being defined and should include this itself
 
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
 #include <OpenImageIO/timer.h>
 
 #include "llvm_headers.h"
@@ -40,6 +49,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/PrettyStackTrace.h>
 #include <llvm/ExecutionEngine/JITMemoryManager.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
 #include "oslexec_pvt.h"
 #include "oslops.h"
@@ -533,6 +544,21 @@ RuntimeOptimizer::llvm_type_sg_ptr ()
 
 
 
+namespace {
+
+/// A param that gets a slot in the group data, and how many times the
+/// code of its layer refers to it.  Sorts most used first.
+struct GroupDataParam {
+    int layer, uses;
+    Symbol *sym;
+    GroupDataParam (int l, int u, Symbol *s) : layer(l), uses(u), sym(s) { }
+    bool operator< (const GroupDataParam &p) const { return uses > p.uses; }
+};
+
+};  // anon namespace
+
+
+
 const llvm::Type *
 RuntimeOptimizer::llvm_type_groupdata ()
 {
@@ -547,46 +573,99 @@ RuntimeOptimizer::llvm_type_groupdata ()
     int sz = (m_num_used_layers + 3) & (~3);  // Round up to 32 bit boundary
     fields.push_back (llvm::ArrayType::get(llvm_type_bool(), sz));
     size_t offset = sz * sizeof(bool);
-
-    // For each layer in the group, add entries for all params that are
-    // connected or interpolated, and output params.  Also mark those
-    // symbols with their offset within the group struct.
-    if (shadingsys().llvm_debug() >= 2)
-        std::cout << "Group param struct:\n";
-    m_param_order_map.clear ();
-    int order = 1;
+    size_t maxalign = sizeof(int);
+
+    // Sort the params of each layer into the "hot" ones that the code
+    // actually reads or writes (or that feed downstream layers), most
+    // used first, and the "cold" ones that only hold values for the
+    // renderer to query.  All the hot ones go first, in layer order, so
+    // the part of the group data touched by a shade is compact.
+    std::vector<GroupDataParam> hot, cold;
+    std::vector<int> uses;
     for (int layer = 0;  layer < m_group.nlayers();  ++layer) {
         ShaderInstance *inst = m_group[layer];
         if (inst->unused())
             continue;
+        uses.assign (inst->symbols().size(), 0);
+        BOOST_FOREACH (const Opcode &op, inst->ops())
+            for (int a = 0;  a < op.nargs();  ++a)
+                ++uses[inst->arg (op.firstarg()+a)];
+        size_t firsthot = hot.size();
         FOREACH_PARAM (Symbol &sym, inst) {
-            TypeSpec ts = sym.typespec();
-            if (ts.is_structure())  // skip the struct symbol itself
+            if (sym.typespec().is_structure())  // skip the struct symbol
                 continue;
-            int arraylen = std::max (1, sym.typespec().arraylength());
-            int n = arraylen * (sym.has_derivs() ? 3 : 1);
-            ts.make_array (n);
-            fields.push_back (llvm_type (ts));
-
-            // Alignment
-            size_t align = sym.typespec().is_closure() ? sizeof(void*) :
-                    sym.typespec().simpletype().basesize();
-            if (offset & (align-1))
-                offset += align - (offset & (align-1));
-            if (shadingsys().llvm_debug() >= 2)
-                std::cout << "  " << inst->layername() 
-                          << " (" << inst->id() << ") " << sym.mangled()
-                          << " " << ts.c_str() << ", field " << order 
-                          << ", offset " << offset << std::endl;
-            sym.dataoffset ((int)offset);
-            offset += n * int(sym.size());
-
-            m_param_order_map[&sym] = order;
-            ++order;
+            int u = uses[&sym - inst->symbol(0)];
+            if (u || sym.connected_down())
+                hot.push_back (GroupDataParam (layer, u, &sym));
+            else
+                cold.push_back (GroupDataParam (layer, 0, &sym));
         }
+        std::stable_sort (hot.begin()+firsthot, hot.end());
     }
+    size_t nhot = hot.size();
+    hot.insert (hot.end(), cold.begin(), cold.end());
+
+    // Add entries for all of those params.  Also mark those symbols
+    // with their offset within the group struct.
+    if (shadingsys().llvm_debug() >= 2)
+        std::cout << "Group param struct:\n";
+    m_param_order_map.clear ();
+    int order = 1;
+    size_t hotsize = offset;
+    std::vector<size_t> layersize (m_group.nlayers(), 0);
+    for (size_t i = 0;  i < hot.size();  ++i) {
+        Symbol &sym (*hot[i].sym);
+        TypeSpec ts = sym.typespec();
+        int arraylen = std::max (1, sym.typespec().arraylength());
+        int n = arraylen * (sym.has_derivs() ? 3 : 1);
+        ts.make_array (n);
+        fields.push_back (llvm_type (ts));
+
+        // Alignment
+        size_t align = sym.typespec().is_closure() ? sizeof(void*) :
+                sym.typespec().simpletype().basesize();
+        if (offset & (align-1))
+            offset += align - (offset & (align-1));
+        maxalign = std::max (maxalign, align);
+        if (shadingsys().llvm_debug() >= 2)
+            std::cout << "  " << m_group[hot[i].layer]->layername()
+                      << " (" << m_group[hot[i].layer]->id() << ") "
+                      << sym.mangled() << " " << ts.c_str()
+                      << (i < nhot ? "" : " (cold)") << ", field " << order
+                      << ", offset " << offset << std::endl;
+        sym.dataoffset ((int)offset);
+        offset += n * int(sym.size());
+        layersize[hot[i].layer] += n * int(sym.size());
+        if (i < nhot)
+            hotsize = offset;
+
+        m_param_order_map[&sym] = order;
+        ++order;
+    }
+
+    // Pad the end to the SIMD width (and at least the most strictly
+    // aligned field), so that the group data for consecutive points (as
+    // laid out by execute_batch) all start on a vector boundary.
+    maxalign = std::max (maxalign, size_t(16));
+    if (offset & (maxalign-1))
+        offset += maxalign - (offset & (maxalign-1));
     m_group.llvm_groupdata_size (offset);
 
+    m_stat_groupdata_size = offset;
+    m_stat_groupdata_hot_size = hotsize;
+    m_stat_groupdata_layers = m_num_used_layers;
+    if (shadingsys().debug()) {
+        shadingsys().info ("Group data: %llu bytes (%llu hot)",
+                           (unsigned long long)offset,
+                           (unsigned long long)hotsize);
+        for (int layer = 0;  layer < m_group.nlayers();  ++layer)
+            if (! m_group[layer]->unused())
+                shadingsys().info ("    layer %s (%d): %llu bytes",
+                                   m_group[layer]->layername().c_str(),
+                                   m_group[layer]->id(),
+                                   (unsigned long long)layersize[layer]);
+    }
+
     m_llvm_type_groupdata = llvm::StructType::get (llvm_context(), fields);
 
 #ifdef DEBUG
@@ -726,6 +805,12 @@ RuntimeOptimizer::llvm_constant_bool (bool i)
 llvm::Value *
 RuntimeOptimizer::llvm_constant (ustring s)
 {
+    // Relocatable code refers to the string by its characters, and the
+    // JIT binds it to the ustring's address in this process.
+    if (m_llvm_relocatable && s.c_str())
+        return llvm_external_ptr ((void *)s.c_str(), "osl$str$" + s.string(),
+                                  llvm_type_string());
+
     // Create a const size_t with the ustring contents
     size_t bits = sizeof(size_t)*8;
     llvm::Value *str = llvm::ConstantInt::get (llvm_context(),
@@ -749,6 +834,58 @@ RuntimeOptimizer::llvm_constant_ptr (void *p)
 
 
 
+llvm::Value *
+RuntimeOptimizer::llvm_external_ptr (void *addr, const std::string &name,
+                                     const llvm::PointerType *type)
+{
+    if (! m_llvm_relocatable)
+        return llvm_constant_ptr (addr, type);
+    if (! addr)
+        return llvm::ConstantPointerNull::get (type);
+
+    // Declare (just once per module) an external byte with the given
+    // name, and remember the address it should be bound to.
+    llvm::GlobalVariable *gv = llvm_module()->getNamedGlobal (name);
+    if (! gv)
+        gv = new llvm::GlobalVariable (*llvm_module(),
+                                       llvm::Type::getInt8Ty (llvm_context()),
+                                       false, llvm::GlobalValue::ExternalLinkage,
+                                       NULL, name);
+    m_llvm_external_addrs[name] = addr;
+    return llvm::ConstantExpr::getBitCast (gv, type);
+}
+
+
+
+llvm::Value *
+RuntimeOptimizer::llvm_constant_bytes_ptr (const void *data, size_t len)
+{
+    if (! m_llvm_relocatable)
+        return llvm_constant_ptr ((void *)data);
+
+    // Copy the bytes into a private constant global in the module
+    std::pair<const void *,size_t> key (data, len);
+    llvm::Constant *&gv (m_llvm_const_data[key]);
+    if (! gv) {
+        const llvm::Type *bytetype = llvm::Type::getInt8Ty (llvm_context());
+        const unsigned char *bytes = (const unsigned char *) data;
+        std::vector<llvm::Constant *> vals (len);
+        for (size_t i = 0;  i < len;  ++i)
+            vals[i] = llvm::ConstantInt::get (bytetype, bytes[i]);
+        const llvm::ArrayType *type = llvm::ArrayType::get (bytetype, len);
+        llvm::GlobalVariable *var = new llvm::GlobalVariable (*llvm_module(),
+                                        type, true,
+                                        llvm::GlobalValue::PrivateLinkage,
+                                        llvm::ConstantArray::get (type, vals),
+                                        "osl$const");
+        var->setAlignment (16);
+        gv = var;
+    }
+    return llvm_void_ptr (gv);
+}
+
+
+
 llvm::Value *
 RuntimeOptimizer::llvm_constant (const TypeDesc &type)
 {
@@ -933,7 +1070,24 @@ RuntimeOptimizer::llvm_get_pointer (const Symbol& sym, int deriv,
 
     if (sym.symtype() == SymTypeConst) {
         // For constants, just return *OUR* pointer to the constant values.
-        return llvm_ptr_cast (llvm_constant_ptr (sym.data()),
+        llvm::Value *data;
+        if (m_llvm_relocatable &&
+                sym.typespec().simpletype().basetype == TypeDesc::STRING) {
+            // The string pointers themselves need to be bound at JIT
+            // time, so make an array of them in the module.
+            int n = sym.size() / sizeof(ustring);
+            std::vector<llvm::Constant *> strs (n);
+            for (int i = 0;  i < n;  ++i)
+                strs[i] = llvm::cast<llvm::Constant> (llvm_constant (((ustring *)sym.data())[i]));
+            const llvm::ArrayType *type = llvm::ArrayType::get (llvm_type_string(), n);
+            data = new llvm::GlobalVariable (*llvm_module(), type, true,
+                                             llvm::GlobalValue::PrivateLinkage,
+                                             llvm::ConstantArray::get (type, strs),
+                                             "osl$strconst");
+        } else {
+            data = llvm_constant_bytes_ptr (sym.data(), sym.size());
+        }
+        return llvm_ptr_cast (data,
                               llvm::PointerType::get (llvm_type(sym.typespec()), 0));
     }
 
@@ -3311,7 +3465,7 @@ LLVMGEN (llvm_gen_getattribute)
     args.push_back (rop.llvm_load_value (Attribute));
     args.push_back (rop.llvm_constant ((int)array_lookup));
     args.push_back (rop.llvm_load_value (Index));
-    args.push_back (rop.llvm_constant_ptr ((void *) dest_type));
+    args.push_back (rop.llvm_constant_bytes_ptr (dest_type, sizeof(TypeDesc)));
     args.push_back (rop.llvm_void_ptr (Destination));
 
     llvm::Value *r = rop.llvm_call_function ("osl_get_attribute", &args[0], args.size());
@@ -3351,6 +3505,28 @@ RuntimeOptimizer::llvm_assign_initial_value (const Symbol& sym)
     if (sym.has_init_ops() && sym.valuesource() == Symbol::DefaultVal) {
         // Handle init ops.
         build_llvm_code (sym.initbegin(), sym.initend());
+    } else if (sym.interactive() && sym.valuesource() == Symbol::InstanceVal) {
+        // The renderer may change an interactive param's value after
+        // we compile, so rather than a constant, read the instance's
+        // value every time.  That address is only good in this
+        // process, so the group can't go in the JIT cache.
+        mark_uncacheable ();
+        TypeDesc t = sym.typespec().simpletype();
+        const llvm::PointerType *ptrtype =
+            t.basetype == TypeDesc::FLOAT ? llvm_type_float_ptr() :
+            t.basetype == TypeDesc::INT ? llvm_type_int_ptr() :
+            llvm::PointerType::get (llvm_type_string(), 0);
+        llvm::Value *src = llvm_constant_ptr (sym.data(), ptrtype);
+        int num_components = t.aggregate;
+        for (int a = 0, c = 0; a < arraylen;  ++a) {
+            llvm::Value *arrind = sym.typespec().is_array() ? llvm_constant(a) : NULL;
+            for (int i = 0; i < num_components; ++i, ++c) {
+                llvm::Value *ptr = builder().CreateConstGEP1_32 (src, c);
+                llvm_store_value (builder().CreateLoad (ptr), sym, 0, arrind, i);
+            }
+        }
+        if (sym.has_derivs())
+            llvm_zero_derivs (sym);
     } else {
         // Use default value
         int num_components = sym.typespec().simpletype().aggregate;
@@ -3644,7 +3820,7 @@ llvm_gen_keyword_fill(RuntimeOptimizer &rop, Opcode &op, const ClosureRegistry::
         }
 
         llvm::Value *key_to     = rop.builder().CreateConstGEP2_32 (attr_p, attr_i, 0);
-        llvm::Value *key_const  = rop.llvm_constant_ptr(*((void **)key), rop.llvm_type_string());
+        llvm::Value *key_const  = rop.llvm_constant (*key);
         llvm::Value *value_to   = rop.builder().CreateConstGEP2_32 (attr_p, attr_i, 1);
         llvm::Value *value_from = rop.llvm_void_ptr (Value);
         value_to = rop.llvm_ptr_cast (value_to, rop.llvm_type_void_ptr());
@@ -3679,7 +3855,7 @@ LLVMGEN (llvm_gen_closure)
 
     // Call osl_allocate_closure_component(closure, id, size).  It returns
     // the memory for the closure parameter data.
-    llvm::Value *render_ptr = rop.llvm_constant_ptr(rop.shadingsys().renderer(), rop.llvm_type_void_ptr());
+    llvm::Value *render_ptr = rop.llvm_external_ptr (rop.shadingsys().renderer(), "osl$renderer", rop.llvm_type_void_ptr());
     llvm::Value *sg_ptr = rop.sg_void_ptr();
     llvm::Value *id_int = rop.llvm_constant(clentry->id);
     llvm::Value *size_int = rop.llvm_constant(clentry->struct_size);
@@ -3697,7 +3873,7 @@ LLVMGEN (llvm_gen_closure)
     // zero out the closure parameter memory.
     if (clentry->prepare) {
         // Call clentry->prepare(renderservices *, int id, void *mem)
-        llvm::Value *funct_ptr = rop.llvm_constant_ptr((void *)clentry->prepare, rop.llvm_type_prepare_closure_func());
+        llvm::Value *funct_ptr = rop.llvm_external_ptr ((void *)clentry->prepare, "osl$prepare$" + closure_name.string(), rop.llvm_type_prepare_closure_func());
         llvm::Value *args[3] = {render_ptr, id_int, mem_void_ptr};
         rop.builder().CreateCall (funct_ptr, args, args+3);
     } else {
@@ -3728,7 +3904,7 @@ LLVMGEN (llvm_gen_closure)
     // setup(render_services, id, mem_ptr).
     if (clentry->setup) {
         // Call clentry->setup(renderservices *, int id, void *mem)
-        llvm::Value *funct_ptr = rop.llvm_constant_ptr((void *)clentry->setup, rop.llvm_type_setup_closure_func());
+        llvm::Value *funct_ptr = rop.llvm_external_ptr ((void *)clentry->setup, "osl$setup$" + closure_name.string(), rop.llvm_type_setup_closure_func());
         llvm::Value *args[3] = {render_ptr, id_int, mem_void_ptr};
         rop.builder().CreateCall (funct_ptr, args, args+3);
     }
@@ -3813,6 +3989,8 @@ LLVMGEN (llvm_gen_pointcloud_search)
     // Every pointcloud call that appears in the code gets its own query object.
     // Not a big waste, and it can be used until the end of the render. It is a
     // constant handle that we put in the arguments for the renderer.
+    // It's only meaningful to this process, so the group can't be cached.
+    rop.mark_uncacheable ();
     args[query_pos] = rop.llvm_constant_ptr(attr_query, rop.llvm_type_void_ptr());
 
     llvm::Value *ret = rop.llvm_call_function ("osl_pointcloud", &args[0], args.size());
@@ -4170,6 +4348,29 @@ RuntimeOptimizer::build_llvm_instance (bool groupentry)
                 }
             }
         }
+        // With "clearmemory", rather than have the context clear the
+        // whole heap, zero just the params that could be queried
+        // without having been written: those of layers that are only
+        // run on demand, and those that their layer doesn't initialize
+        // because it never reads them.  (Everything else, the layers
+        // write before anything reads it.)  "clearmemory_partial" 0
+        // leaves it all to the context instead.
+        if (shadingsys().m_clearmemory &&
+                shadingsys().m_clearmemory_partial) {
+            for (int i = 0;  i < group().nlayers();  ++i) {
+                ShaderInstance *gi = group()[i];
+                if (gi->unused())
+                    continue;
+                FOREACH_PARAM (Symbol &sym, gi) {
+                    if (sym.typespec().is_structure() ||
+                            sym.typespec().is_closure())
+                        continue;
+                    if (gi->run_lazily() || (! sym.everread() &&
+                            ! sym.connected_down() && ! sym.connected()))
+                        llvm_assign_zero (sym);
+                }
+            }
+        }
     }
 
     // Setup the symbols
@@ -4251,6 +4452,19 @@ RuntimeOptimizer::build_llvm_instance (bool groupentry)
 
 
 
+/// Count the instructions in all the functions of the module.
+static long long
+llvm_module_instructions (llvm::Module *module)
+{
+    long long n = 0;
+    for (llvm::Module::iterator f = module->begin();  f != module->end();  ++f)
+        for (llvm::Function::iterator b = f->begin();  b != f->end();  ++b)
+            n += b->size();
+    return n;
+}
+
+
+
 void
 RuntimeOptimizer::build_llvm_group ()
 {
@@ -4281,12 +4495,27 @@ RuntimeOptimizer::build_llvm_group ()
         if (index != -1) funcs[index] = build_llvm_instance (lastlayer);
     }
     llvm::Function* entry_func = funcs[m_num_used_layers-1];
+
+    // With "inline_layers", have the inliner fold each layer that's run
+    // from only one place into its caller (and so on up to the group
+    // entry), so that LLVM optimizes across the connections: values
+    // stored to a downstream layer's params get forwarded to its loads
+    // of them, and the "layer has run" checks fold away.  Layers run
+    // from several places stay separate, so no code is duplicated.
+    // The quick first tier doesn't run the inliner at all.
+    if (shadingsys().inline_layers() && ! m_llvm_quick) {
+        for (int i = 0;  i < m_num_used_layers-1;  ++i)
+            if (funcs[i]->hasOneUse())
+                funcs[i]->addFnAttr (llvm::Attribute::AlwaysInline);
+    }
     m_stat_llvm_irgen_time = timer();  timer.reset();  timer.start();
 
     // Optimize the LLVM IR unless it's just a ret void group (1 layer, 1 BB, 1 inst == retvoid)
     bool skip_optimization = m_num_used_layers == 1 && entry_func->size() == 1 && entry_func->front().size() == 1;
     // Label the group as being retvoid or not.
     m_group.does_nothing(skip_optimization);
+    m_group.inits_groupdata (shadingsys().m_clearmemory &&
+                             shadingsys().m_clearmemory_partial);
     if (!skip_optimization) {
 #if 0
       // First do the simple function passes
@@ -4298,8 +4527,18 @@ RuntimeOptimizer::build_llvm_group ()
       m_llvm_func_passes->doFinalization();
 #endif
 
-      // Next do the module passes
-      m_llvm_passes->run (*llvm_module());
+      // Next do the module passes -- one at a time, if we're timing them
+      if (m_llvm_timed_passes.size()) {
+          for (size_t i = 0;  i < m_llvm_timed_passes.size();  ++i) {
+              long long ninsts = llvm_module_instructions (llvm_module());
+              Timer passtimer;
+              m_llvm_timed_passes[i].second->run (*llvm_module());
+              add_pass_stats (m_llvm_timed_passes[i].first, passtimer(),
+                              ninsts - llvm_module_instructions (llvm_module()));
+          }
+      } else {
+          m_llvm_passes->run (*llvm_module());
+      }
 
 #if 0
       // Now do additional highly optimized function passes on just the
@@ -4327,10 +4566,35 @@ RuntimeOptimizer::build_llvm_group ()
         llvm::WriteBitcodeToFile (llvm_module(), out);
     }
 
+    // Save the optimized module to the JIT cache (but not quick
+    // first-tier code, it'll be stored when it's recompiled), then tell
+    // the engine the real addresses of the names we used in place of
+    // pointers.
+    llvm::ExecutionEngine* ee = m_llvm_state->exec;
+    if (m_llvm_relocatable) {
+        if (m_llvm_quick) {
+            // nothing to store yet
+        } else if (m_jitcache_ok) {
+            jitcache_store (funcs, m_num_used_layers);
+        } else {
+            spin_lock lock (shadingsys().m_stat_mutex);
+            ++shadingsys().m_stat_jitcache_uncacheable;
+        }
+        for (std::map<std::string,void*>::const_iterator i = m_llvm_external_addrs.begin();
+             i != m_llvm_external_addrs.end();  ++i) {
+            llvm::GlobalVariable *gv = llvm_module()->getNamedGlobal (i->first);
+            if (gv)
+                ee->addGlobalMapping (gv, i->second);
+        }
+    }
+
     // Force the JIT to happen now, while we have the lock
-    llvm::ExecutionEngine* ee = shadingsys().ExecutionEngine();
-    RunLLVMGroupFunc f = (RunLLVMGroupFunc) ee->getPointerToFunction(entry_func);
+    RunLLVMGroupFunc f = llvm_jit_group (entry_func);
     m_group.llvm_compiled_version (f);
+    {
+        spin_lock lock (shadingsys().m_stat_mutex);
+        ++shadingsys().m_stat_groups_compiled;
+    }
 
     // Remove the IR for the group layer functions, we've already JITed it
     // and will never need the IR again.  This saves memory, and also saves
@@ -4343,10 +4607,13 @@ RuntimeOptimizer::build_llvm_group ()
 #if 1
     // Free the exec and module to reclaim all the memory.  This definitely
     // saves memory, and has almost no effect on runtime.
-    delete shadingsys().m_llvm_exec;
+    {
+        LLVMJitLock jit_lock (m_stat_opt_locking_time);
+        delete m_llvm_state->exec;
+    }
     // N.B. Destroying the EE should have destroyed the module as well.
-    shadingsys().m_llvm_exec = NULL;
-    shadingsys().m_llvm_module = NULL;
+    m_llvm_state->exec = NULL;
+    m_llvm_state->module = NULL;
 #endif
 
 #if 0
@@ -4355,10 +4622,13 @@ RuntimeOptimizer::build_llvm_group ()
     // held in the context.  Answer: nothing appreciable, not worth the
     // extra work of constant creation and tear-down.
     delete m_llvm_passes;  m_llvm_passes = NULL;
+    for (size_t i = 0;  i < m_llvm_timed_passes.size();  ++i)
+        delete m_llvm_timed_passes[i].second;
+    m_llvm_timed_passes.clear ();
     delete m_llvm_func_passes;  m_llvm_func_passes = NULL;
     delete m_llvm_func_passes_optimized;  m_llvm_func_passes_optimized = NULL;
-    delete shadingsys().m_llvm_context;
-    shadingsys().m_llvm_context = NULL;
+    delete m_llvm_state->context;
+    m_llvm_state->context = NULL;
 #endif
 
     m_stat_llvm_jit_time = timer();
@@ -4373,8 +4643,8 @@ RuntimeOptimizer::initialize_llvm_group ()
     // static spin_mutex mutex;
     // spin_lock lock (mutex);
 
-    m_llvm_context = m_shadingsys.llvm_context ();
-    m_llvm_module = m_shadingsys.m_llvm_module;
+    m_llvm_context = m_llvm_state->context;
+    m_llvm_module = m_llvm_state->module;
     ASSERT (m_llvm_context && m_llvm_module);
 
     llvm_setup_optimization_passes ();
@@ -4449,12 +4719,15 @@ RuntimeOptimizer::initialize_llvm_group ()
 
 /// OSL_Dummy_JITMemoryManager - Create a shell that passes on requests
 /// to a real JITMemoryManager underneath, but can be retained after the
-/// dummy is destroyed.  Also, we don't pass along any deallocations.
+/// dummy is destroyed.  Also, we don't pass along any deallocations --
+/// the code lives until the LLVMJitMemory noting its blocks is freed.
 class OSL_Dummy_JITMemoryManager : public llvm::JITMemoryManager {
 protected:
     llvm::JITMemoryManager *mm;
+    LLVMJitMemory &jitmem;
 public:
-    OSL_Dummy_JITMemoryManager(llvm::JITMemoryManager *realmm) : mm(realmm) { }
+    OSL_Dummy_JITMemoryManager(LLVMJitMemory &mem)
+        : mm(mem.mm()), jitmem(mem) { }
     virtual ~OSL_Dummy_JITMemoryManager() { }
     virtual void setMemoryWritable() { mm->setMemoryWritable(); }
     virtual void setMemoryExecutable() { mm->setMemoryExecutable(); }
@@ -4473,6 +4746,7 @@ public:
     virtual void endFunctionBody(const llvm::Function *F,
                                  uint8_t *FunctionStart, uint8_t *FunctionEnd) {
         mm->endFunctionBody (F, FunctionStart, FunctionEnd);
+        jitmem.add_function (FunctionStart, FunctionEnd - FunctionStart);
     }
     virtual uint8_t *allocateSpace(intptr_t Size, unsigned Alignment) {
         return mm->allocateSpace (Size, Alignment);
@@ -4490,6 +4764,7 @@ public:
     virtual void endExceptionTable(const llvm::Function *F, uint8_t *TableStart,
                                    uint8_t *TableEnd, uint8_t* FrameRegister) {
         mm->endExceptionTable (F, TableStart, TableEnd, FrameRegister);
+        jitmem.add_exception_table (TableStart, TableEnd - TableStart);
     }
     virtual void deallocateExceptionTable(void *ET) {
         // DON'T DEALLOCATE mm->deallocateExceptionTable(ET);
@@ -4513,63 +4788,370 @@ public:
 
 
 
+LLVMJitMemory::LLVMJitMemory (ShadingSystemImpl &shadingsys)
+    : m_shadingsys(shadingsys), m_bytes(0), m_size(0)
+{
+}
+
+
+
+LLVMJitMemory::~LLVMJitMemory ()
+{
+    {
+        // The shared manager isn't thread-safe; it's only touched by
+        // the serialized JIT steps.
+        lock_guard jit_lock (ShadingSystemImpl::llvm_jit_mutex ());
+        BOOST_FOREACH (void *body, m_functions)
+            mm()->deallocateFunctionBody (body);
+        BOOST_FOREACH (void *table, m_exception_tables)
+            mm()->deallocateExceptionTable (table);
+    }
+    spin_lock lock (m_shadingsys.m_stat_mutex);
+    m_shadingsys.m_stat_mem_jit -= m_size;
+    m_shadingsys.m_stat_mem_jit_freed += m_size;
+}
+
+
+
+llvm::JITMemoryManager *
+LLVMJitMemory::mm () const
+{
+    return m_shadingsys.m_llvm_jitmm;
+}
+
+
+
+void
+LLVMJitMemory::add_function (void *start, size_t size)
+{
+    m_functions.push_back (start);
+    m_bytes += size;
+}
+
+
+
+void
+LLVMJitMemory::add_exception_table (void *start, size_t size)
+{
+    m_exception_tables.push_back (start);
+    m_bytes += size;
+}
+
+
+
+void
+LLVMJitMemory::update_size ()
+{
+    spin_lock lock (m_shadingsys.m_stat_mutex);
+    m_shadingsys.m_stat_mem_jit += m_bytes - m_size;
+    m_size = m_bytes;
+}
+
+
+
+/// Deleter for LLVMJitMemoryRef: rather than freeing the memory right
+/// away, let the ShadingSystem hold it until no code can be running in it.
+struct RetireLLVMJitMemory {
+    void operator() (LLVMJitMemory *mem) const {
+        mem->shadingsys().retire_llvm_jit_memory (mem);
+    }
+};
+
+
+
+/// OSL_PerfMapListener - Tells the ShadingSystem about each function the
+/// JIT emits, so it can be listed in the perf symbol map as
+/// "osl:<group>/<function>".
+class OSL_PerfMapListener : public llvm::JITEventListener {
+public:
+    OSL_PerfMapListener (ShadingSystemImpl &shadingsys,
+                         const std::string &groupname)
+        : m_shadingsys(shadingsys), m_groupname(groupname) { }
+    virtual void NotifyFunctionEmitted (const llvm::Function &F, void *Code,
+                                        size_t Size,
+                                        const EmittedFunctionDetails &) {
+        m_shadingsys.perf_map_add (Code, Size, Strutil::format ("osl:%s/%s",
+                                       m_groupname.c_str(),
+                                       F.getName().str().c_str()));
+    }
+private:
+    ShadingSystemImpl &m_shadingsys;
+    std::string m_groupname;
+};
+
+
+
+void
+ShadingSystemImpl::perf_map_add (const void *code, size_t size,
+                                 const std::string &name)
+{
+    lock_guard lock (m_perf_map_mutex);
+    if (! m_perf_map_file) {
+        std::string filename = Strutil::format ("/tmp/perf-%d.map",
+                                                (int)getpid());
+        m_perf_map_file = fopen (filename.c_str(), "a");
+        if (! m_perf_map_file) {
+            warning ("Could not open %s, not writing perf map",
+                     filename.c_str());
+            m_perf_map = false;
+            return;
+        }
+    }
+    fprintf (m_perf_map_file, "%llx %llx %s\n", (unsigned long long)code,
+             (unsigned long long)size, name.c_str());
+    fflush (m_perf_map_file);
+}
+
+
+
+// The old JIT keeps process-wide state that isn't safe to share among
+// engines working at the same time -- the target's lazy compilation
+// callback and stub resolver, for instance -- and LLVM 2.x makes no
+// promise that one engine's code generation may overlap another's.  So
+// while IR generation and optimization run in parallel, each in its own
+// context, the steps that touch the JIT itself (creating and destroying
+// engines, and generating machine code) are done one at a time.
+static mutex the_jit_mutex;
+
+
+
+mutex &
+ShadingSystemImpl::llvm_jit_mutex ()
+{
+    return the_jit_mutex;
+}
+
+
+
+LLVMJitLock::LLVMJitLock (double &wait_time)
+    : m_lock (the_jit_mutex, boost::defer_lock)
+{
+    Timer timer;
+    m_lock.lock ();
+    wait_time += timer();
+}
+
+
+
+RunLLVMGroupFunc
+RuntimeOptimizer::llvm_jit_group (llvm::Function *entry)
+{
+    llvm::ExecutionEngine *ee = m_llvm_state->exec;
+    RunLLVMGroupFunc f;
+    LLVMJitLock jit_lock (m_stat_opt_locking_time);
+    if (m_shadingsys.perf_map()) {
+        // Name the group after its last layer, like the entry function
+        ShaderInstance *last = m_group[m_group.nlayers()-1];
+        OSL_PerfMapListener listener (m_shadingsys,
+                Strutil::format ("%s_%d", last->layername().c_str(),
+                                 last->id()));
+        ee->RegisterJITEventListener (&listener);
+        f = (RunLLVMGroupFunc) ee->getPointerToFunction (entry);
+        ee->UnregisterJITEventListener (&listener);
+    } else {
+        f = (RunLLVMGroupFunc) ee->getPointerToFunction (entry);
+    }
+    m_llvm_state->jitmem->update_size ();
+    m_group.add_llvm_jit_memory (m_llvm_state->jitmem);
+    return f;
+}
+
+
+
+LLVMJitState *
+ShadingSystemImpl::acquire_llvm_state ()
+{
+    lock_guard lock (m_llvm_states_mutex);
+    if (m_llvm_free_states.size()) {
+        LLVMJitState *state = m_llvm_free_states.back();
+        m_llvm_free_states.pop_back ();
+        return state;
+    }
+    // All existing states are busy JITing other groups (or there are
+    // none yet) -- make a new one.  It will be fully set up by SetupLLVM.
+    LLVMJitState *state = new LLVMJitState;
+    m_llvm_states.push_back (state);
+    return state;
+}
+
+
+
+void
+ShadingSystemImpl::release_llvm_state (LLVMJitState *state)
+{
+    // Unless the group claimed it, the JIT memory is freed here
+    state->jitmem.reset ();
+    lock_guard lock (m_llvm_states_mutex);
+    m_llvm_free_states.push_back (state);
+}
+
+
+
 void
-ShadingSystemImpl::SetupLLVM ()
+ShadingSystemImpl::retire_llvm_jit_memory (LLVMJitMemory *mem)
 {
-    if (! m_llvm_context) {
-        // First time through -- basic LLVM context setup
-        info ("Setting up LLVM");
-        llvm::DisablePrettyStackTrace = true;
-        llvm::llvm_start_multithreaded ();  // enable it to be thread-safe
-        m_llvm_context = new llvm::LLVMContext();
-        llvm::InitializeNativeTarget();
+    // Groups clear their function pointer before letting go of the code,
+    // so only threads already holding a context can still be in it.
+    {
+        spin_lock lock (m_jit_epoch_mutex);
+        m_retired_jit_memory.push_back (std::make_pair (++m_jit_epoch, mem));
+    }
+    free_retired_llvm_jit_memory ();
+}
+
+
 
-        initialize_llvm_generator_table ();
+void
+ShadingSystemImpl::free_retired_llvm_jit_memory ()
+{
+    std::vector<std::pair<long long,LLVMJitMemory *> > retired;
+    {
+        spin_lock lock (m_jit_epoch_mutex);
+        // Memory retired in epoch e may still be running in contexts
+        // checked out before it, in an epoch < e.
+        long long oldest = m_jit_epoch;
+        if (! m_context_epochs.empty())
+            oldest = m_context_epochs.begin()->first;
+        size_t n = 0;
+        while (n < m_retired_jit_memory.size() &&
+               m_retired_jit_memory[n].first <= oldest)
+            ++n;
+        if (n == 0)
+            return;   // someone may still be running it; try again later
+        retired.assign (m_retired_jit_memory.begin(),
+                        m_retired_jit_memory.begin() + n);
+        m_retired_jit_memory.erase (m_retired_jit_memory.begin(),
+                                    m_retired_jit_memory.begin() + n);
     }
+    for (size_t i = 0;  i < retired.size();  ++i)
+        delete retired[i].second;
+}
 
-    if (! m_llvm_jitmm)
-        m_llvm_jitmm = llvm::JITMemoryManager::CreateDefaultMemManager();
 
-    if (! m_llvm_module) {
+
+bool
+ShadingSystemImpl::SetupLLVM (LLVMJitState &state, double &lock_time,
+                              llvm::MemoryBuffer *bitcode)
+{
+    {
+        // First time through -- one-time global LLVM setup
+        static spin_mutex init_mutex;
+        static bool initialized = false;
+        spin_lock lock (init_mutex);
+        if (! initialized) {
+            info ("Setting up LLVM");
+            llvm::DisablePrettyStackTrace = true;
+            // Make LLVM's own global locks real, before any thread has
+            // created any LLVM objects.
+            llvm::llvm_start_multithreaded ();
+            llvm::InitializeNativeTarget();
+            initialize_llvm_generator_table ();
+            initialized = true;
+        }
+    }
+
+    if (! state.context)
+        state.context = new llvm::LLVMContext();
+
+    if (! state.module && bitcode) {
+        // A previously compiled group from the JIT cache
+        std::string err;
+        state.module = llvm::ParseBitcodeFile (bitcode, *state.context, &err);
+        if (! state.module) {
+            warning ("Could not parse cached shader group: %s", err.c_str());
+            return false;
+        }
+    }
+
+    if (! state.module) {
 #ifdef OSL_LLVM_NO_BITCODE
-        m_llvm_module = new llvm::Module("llvm_ops", *llvm_context());
+        state.module = new llvm::Module("llvm_ops", *state.context);
 #else
-        // Load the LLVM bitcode and parse it into a Module
-        const char *data = osl_llvm_compiled_ops_block;
+        if (! state.ops_module) {
+            // First time through for this context -- load the LLVM
+            // bitcode of the shadeop library and parse it into a Module
+            // that we hold onto for the life of the ShadingSystem.
+            Timer timer;
+            const char *data = osl_llvm_compiled_ops_block;
 #if OSL_LLVM_28
-        llvm::MemoryBuffer* buf = llvm::MemoryBuffer::getMemBuffer (llvm::StringRef(data, osl_llvm_compiled_ops_size));
+            llvm::MemoryBuffer* buf = llvm::MemoryBuffer::getMemBuffer (llvm::StringRef(data, osl_llvm_compiled_ops_size));
 #else
-        llvm::MemoryBuffer *buf =
-            llvm::MemoryBuffer::getMemBuffer (data, data + osl_llvm_compiled_ops_size);
+            llvm::MemoryBuffer *buf =
+                llvm::MemoryBuffer::getMemBuffer (data, data + osl_llvm_compiled_ops_size);
 #endif
-        std::string err;
-        m_llvm_module = llvm::ParseBitcodeFile (buf, *llvm_context(), &err);
-        if (err.length())
-            error ("ParseBitcodeFile returned '%s'\n", err.c_str());
-        delete buf;
+            std::string err;
+            state.ops_module = llvm::ParseBitcodeFile (buf, *state.context, &err);
+            delete buf;
+            if (! state.ops_module) {
+                error ("ParseBitcodeFile returned '%s'\n", err.c_str());
+                return false;
+            }
+            spin_lock stat_lock (m_stat_mutex);
+            m_stat_llvm_ops_parse_time += timer();
+            ++m_stat_llvm_ops_parses;
+        }
+        // Each group gets its own copy of the ops, since the EE takes
+        // ownership of (and eventually destroys) the module it's given.
+        // Cloning the already-parsed module is much cheaper than
+        // parsing the bitcode all over again.
+        Timer timer;
+        state.module = llvm::CloneModule (state.ops_module);
+        spin_lock stat_lock (m_stat_mutex);
+        m_stat_llvm_ops_clone_time += timer();
+        ++m_stat_llvm_ops_clones;
 #endif
     }
 
     // Create the ExecutionEngine
-    if (m_llvm_exec
+    if (state.exec
         && false /* FIXME -- leak the EE for now */) {
-        m_llvm_exec->addModule (m_llvm_module);
+        state.exec->addModule (state.module);
     } else {
+        // Keep track of which of the shared JIT memory is this group's,
+        // so that it can be freed when the group is.
         std::string error_msg;
-        llvm::JITMemoryManager *mm = new OSL_Dummy_JITMemoryManager(m_llvm_jitmm);
-        m_llvm_exec = llvm::ExecutionEngine::createJIT (m_llvm_module,
-                                                        &error_msg, mm);
+        {
+            LLVMJitLock jit_lock (lock_time);
+            if (! m_llvm_jitmm)
+                m_llvm_jitmm = llvm::JITMemoryManager::CreateDefaultMemManager();
+            state.jitmem.reset (new LLVMJitMemory (*this),
+                                RetireLLVMJitMemory());
+            llvm::JITMemoryManager *mm = new OSL_Dummy_JITMemoryManager(*state.jitmem);
+            state.exec = llvm::ExecutionEngine::createJIT (state.module,
+                                                           &error_msg, mm);
+        }
+        if (! state.exec) {
+            error ("Failed to create engine: %s\n", error_msg.c_str());
+            delete state.module;
+            state.module = NULL;
+            state.jitmem.reset ();
+            return false;
+        }
         // Force it to JIT as soon as we ask it for the code pointer,
         // don't take any chances that it might JIT lazily, since we
         // will be stealing the JIT code memory from under its nose and
         // destroying the Module & ExecutionEngine.
-        m_llvm_exec->DisableLazyCompilation ();
-        if (! m_llvm_exec) {
-            error ("Failed to create engine: %s\n", error_msg.c_str());
-            DASSERT (0);
-            return;
-        }
+        state.exec->DisableLazyCompilation ();
+    }
+    return true;
+}
+
+
+
+void
+RuntimeOptimizer::llvm_add_pass (llvm::Pass *pass, const char *name)
+{
+    if (! shadingsys().pass_stats()) {
+        m_llvm_passes->add (pass);
+        return;
     }
+    // Running the passes separately rather than interleaved per
+    // function may change the code a little, but it's the only way to
+    // know what each one costs.
+    llvm::PassManager *passes = new llvm::PassManager;
+    passes->add (new llvm::TargetData (llvm_module()));
+    passes->add (pass);
+    m_llvm_timed_passes.push_back (std::make_pair (name, passes));
 }
 
 
@@ -4597,36 +5179,44 @@ RuntimeOptimizer::llvm_setup_optimization_passes ()
     llvm::FunctionPassManager &fpmo (*m_llvm_func_passes_optimized);
     fpmo.add (new llvm::TargetData(llvm_module()));
 
+    if (m_llvm_quick) {
+        // Quick first-tier code for groups that may only run a handful
+        // of points: promoting allocas to registers is cheap and gets
+        // most of the benefit; skip inlining and everything else.
+        llvm_add_pass (llvm::createPromoteMemoryToRegisterPass(), "mem2reg");
+        llvm_add_pass (llvm::createCFGSimplificationPass(), "simplifycfg");
+        return;
+    }
 
 #if 1
     // Specify everything as a module pass
 
     // Always add verifier?
-    passes.add (llvm::createVerifierPass());
+    llvm_add_pass (llvm::createVerifierPass(), "verify");
     // Simplify the call graph if possible (deleting unreachable blocks, etc.)
-    passes.add (llvm::createCFGSimplificationPass());
+    llvm_add_pass (llvm::createCFGSimplificationPass(), "simplifycfg");
     // Change memory references to registers
 //    passes.add (llvm::createPromoteMemoryToRegisterPass());
-    passes.add (llvm::createScalarReplAggregatesPass());
+    llvm_add_pass (llvm::createScalarReplAggregatesPass(), "scalarrepl");
     // Combine instructions where possible -- peephole opts & bit-twiddling
-    passes.add (llvm::createInstructionCombiningPass());
+    llvm_add_pass (llvm::createInstructionCombiningPass(), "instcombine");
     // Inline small functions
-    passes.add (llvm::createFunctionInliningPass());  // 250?
+    llvm_add_pass (llvm::createFunctionInliningPass(), "inline");  // 250?
     // Eliminate early returns
-    passes.add (llvm::createUnifyFunctionExitNodesPass());
+    llvm_add_pass (llvm::createUnifyFunctionExitNodesPass(), "mergereturn");
     // resassociate exprssions (a = x + (3 + y) -> a = x + y + 3)
-    passes.add (llvm::createReassociatePass());
+    llvm_add_pass (llvm::createReassociatePass(), "reassociate");
     // Eliminate common sub-expressions
-    passes.add (llvm::createGVNPass());
-    passes.add (llvm::createSCCPPass());          // Constant prop with SCCP
+    llvm_add_pass (llvm::createGVNPass(), "gvn");
+    llvm_add_pass (llvm::createSCCPPass(), "sccp");          // Constant prop with SCCP
     // More dead code elimination
-    passes.add (llvm::createAggressiveDCEPass());
+    llvm_add_pass (llvm::createAggressiveDCEPass(), "adce");
     // Combine instructions where possible -- peephole opts & bit-twiddling
-    passes.add (llvm::createInstructionCombiningPass());
+    llvm_add_pass (llvm::createInstructionCombiningPass(), "instcombine");
     // Simplify the call graph if possible (deleting unreachable blocks, etc.)
-    passes.add (llvm::createCFGSimplificationPass());
+    llvm_add_pass (llvm::createCFGSimplificationPass(), "simplifycfg");
     // Try to make stuff into registers one last time.
-    passes.add (llvm::createPromoteMemoryToRegisterPass());
+    llvm_add_pass (llvm::createPromoteMemoryToRegisterPass(), "mem2reg");
 
 #elif 0
     // This code would apply the standard optimizations used by
@@ -44,6 +44,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifdef OIIO_NAMESPACE
 namespace Filesystem = OIIO::Filesystem;
 using OIIO::Timer;
+using OIIO::spin_lock;
 #endif
 
 
@@ -330,6 +331,10 @@ OSOReaderToMaster::hint (const char *hintstring)
         ASSERT (m_master->m_symbols.size() && "structfields hint but no sym");
         Symbol &sym (m_master->m_symbols.back());
         StructSpec *structspec = sym.typespec().structspec();
+        // The struct is shared by every shader using one of its name,
+        // and they may be loading right now, too; only one fills it in.
+        static spin_mutex structfields_mutex;
+        spin_lock lock (structfields_mutex);
         if (structspec->numfields() == 0) {
             while (1) {
                 std::string afield = readuntil (h, ",}", true);
@@ -485,6 +490,39 @@ OSOReaderToMaster::instruction_end ()
 
 
 
+/// Publishes the outcome of loading a shader master, and wakes the
+/// threads waiting for it, when it goes out of scope -- however that
+/// happens, so that a load that fails or throws never leaves behind a
+/// placeholder for others to wait on forever.  Unless told otherwise,
+/// the shader is remembered as having failed to load (NULL).
+class ShadingSystemImpl::MasterLoadGuard {
+public:
+    MasterLoadGuard (ShadingSystemImpl &shadingsys, ustring name)
+        : m_shadingsys(shadingsys), m_name(name), m_forget(false) { }
+    ~MasterLoadGuard () {
+        boost::unique_lock<boost::mutex> lock (m_shadingsys.m_shader_masters_mutex);
+        if (m_forget) {
+            m_shadingsys.m_shader_masters.erase (m_name);
+        } else {
+            MasterLoad &load (m_shadingsys.m_shader_masters[m_name]);
+            load.master = m_master;
+            load.loading = false;
+        }
+        m_shadingsys.m_shader_masters_cond.notify_all ();
+    }
+    /// The shader loaded successfully as r.
+    void loaded (ShaderMaster::ref r) { m_master = r; }
+    /// Forget the shader entirely, so the next request tries again.
+    void forget () { m_forget = true; }
+private:
+    ShadingSystemImpl &m_shadingsys;
+    ustring m_name;
+    ShaderMaster::ref m_master;
+    bool m_forget;
+};
+
+
+
 ShaderMaster::ref
 ShadingSystemImpl::loadshader (const char *cname)
 {
@@ -494,35 +532,70 @@ ShadingSystemImpl::loadshader (const char *cname)
     }
     ++m_stat_shaders_requested;
     ustring name (cname);
-    lock_guard guard (m_mutex);  // Thread safety
-    ShaderNameMap::const_iterator found = m_shader_masters.find (name);
-    if (found != m_shader_masters.end()) {
-        if (debug())
-            info ("Found %s in shader_masters", name.c_str());
-        // Already loaded this shader, return its reference
-        return (*found).second;
+    {
+        // Only hold the lock long enough to look in the map.  If some
+        // other thread is in the middle of loading this shader, wait for
+        // it to finish; otherwise leave an entry saying that we're the
+        // ones loading it, so that nobody else does.
+        boost::unique_lock<boost::mutex> lock (m_shader_masters_mutex);
+        for (;;) {
+            ShaderNameMap::const_iterator found = m_shader_masters.find (name);
+            if (found == m_shader_masters.end())
+                break;
+            if (! found->second.loading) {
+                // Already loaded this shader, return its reference
+                ShaderMaster::ref r = found->second.master;
+                lock.unlock ();
+                if (debug())
+                    info ("Found %s in shader_masters", name.c_str());
+                return r;
+            }
+            m_shader_masters_cond.wait (lock);
+        }
+        m_shader_masters[name];   // loading == true
     }
 
-    // Not found in the map
-    OSOReaderToMaster oso (*this);
+    // Not found in the map, so we're the ones to read it -- without
+    // holding any locks, so that other shaders can be found or loaded
+    // by other threads in the meantime.  A shader that failed to parse
+    // is remembered (as NULL) so we don't keep trying, but one we
+    // couldn't find at all is forgotten, since the searchpath may yet
+    // change.
+    MasterLoadGuard loadguard (*this, name);
+    std::vector<std::string> searchpath;
+    {
+        lock_guard guard (m_mutex);
+        searchpath = m_searchpath_dirs;
+    }
     std::string filename = Filesystem::searchpath_find (name.string() + ".oso",
-                                                        m_searchpath_dirs);
+                                                        searchpath);
+    ShaderMaster::ref r;
     if (filename.empty ()) {
         // FIXME -- error
         error ("No .oso file could be found for shader \"%s\"", name.c_str());
-        return NULL;
-    }
-    Timer timer;
-    bool ok = oso.parse (filename);
-    ShaderMaster::ref r = ok ? oso.master() : NULL;
-    m_shader_masters[name] = r;
-    if (ok) {
-        ++m_stat_shaders_loaded;
-        info ("Loaded \"%s\" (took %s)", filename.c_str(), Strutil::timeintervalformat(timer(), 2).c_str());
+        loadguard.forget ();
     } else {
-        error ("Unable to read \"%s\"", filename.c_str());
+        OSOReaderToMaster oso (*this);
+        Timer timer;
+        bool ok = oso.parse (filename);
+        double parsetime = timer();
+        if (ok) {
+            r = oso.master();
+            ++m_stat_shaders_loaded;
+            {
+                spin_lock lock (m_stat_mutex);
+                m_stat_master_parse_time += parsetime;
+                if (parsetime > m_stat_master_parse_max) {
+                    m_stat_master_parse_max = parsetime;
+                    m_stat_master_parse_slowest = name;
+                }
+            }
+            info ("Loaded \"%s\" (took %s)", filename.c_str(), Strutil::timeintervalformat(parsetime, 2).c_str());
+        } else {
+            error ("Unable to read \"%s\"", filename.c_str());
+        }
+        // FIXME -- catch errors
     }
-    // FIXME -- catch errors
 
     if (r) {
         r->resolve_syms ();
@@ -534,6 +607,7 @@ ShadingSystemImpl::loadshader (const char *cname)
             info ("%s", s.c_str());
     }
 
+    loadguard.loaded (r);
     return r;
 }
 
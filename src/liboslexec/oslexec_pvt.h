@@ -29,14 +29,19 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef OSLEXEC_PVT_H
 #define OSLEXEC_PVT_H
 
+#include <cstdio>
 #include <string>
 #include <vector>
 #include <stack>
+#include <deque>
 #include <map>
 #include <list>
 #include <set>
 
 #include <boost/regex_fwd.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/function.hpp>
 
 #include "OpenImageIO/hash.h"
 #include "OpenImageIO/ustring.h"
@@ -58,6 +63,7 @@ namespace llvm {
   class FunctionPassManager;
   class LLVMContext;
   class Linker;
+  class MemoryBuffer;
   class Module;
   class PassManager;
   class JITMemoryManager;
@@ -87,6 +93,8 @@ class ShadingContext;
 class ShaderInstance;
 typedef shared_ptr<ShaderInstance> ShaderInstanceRef;
 class Dictionary;
+class LLVMJitMemory;
+typedef shared_ptr<LLVMJitMemory> LLVMJitMemoryRef;
 
 
 /// Signature of the function that LLVM generates to run the shader
@@ -264,6 +272,7 @@ private:
 
     friend class OSOReaderToMaster;
     friend class ShaderInstance;
+    friend class RuntimeOptimizer;
 };
 
 
@@ -310,6 +319,10 @@ class ShaderInstance {
 public:
     typedef ShaderInstanceRef ref;
     ShaderInstance (ShaderMaster::ref master, const char *layername="");
+    /// Copy an instance that hasn't been optimized yet (so it has only
+    /// its parameters, values and connections), giving the copy its
+    /// own parameter values and id.
+    ShaderInstance (const ShaderInstance &inst);
     ~ShaderInstance ();
 
     /// Return the layer name of this instance
@@ -332,6 +345,31 @@ public:
     /// 
     void parameters (const ParamValueList &params);
 
+    /// Mark the named parameter (which must already have been given an
+    /// instance value) as one that ReParameter may change.  Return
+    /// false if there's no such parameter.
+    bool make_interactive (ustring name);
+
+    /// Names of the parameters that ReParameter may change.
+    ///
+    const std::vector<ustring> &interactive_params () const {
+        return m_interactive_params;
+    }
+
+    /// Change the value of an interactive parameter, even after the
+    /// instance has been optimized.  Return false if name isn't an
+    /// interactive parameter of type t.
+    bool reparameter (ustring name, TypeDesc t, const void *val);
+
+    /// If we have a param that would get the userdata p as it runs,
+    /// give it p's value instead, as a lockgeom instance value.  Return
+    /// true if there was such a param.
+    bool fold_userdata (const ParamValue &p);
+
+    /// Would fold_userdata(p) find a param to give p's value to?
+    ///
+    bool can_fold_userdata (const ParamValue &p) const;
+
     /// Find the named symbol, return its index in the symbol array, or
     /// -1 if not found.
     int findsymbol (ustring name) const;
@@ -434,6 +472,10 @@ public:
     ///
     void copy_code_from_master ();
 
+    /// Point the data of our parameters that take instance values at
+    /// our own copies of those values.
+    void bind_instance_values ();
+
 private:
     ShaderMaster::ref m_master;         ///< Reference to the master
     SymbolVec m_instsymbols;            ///< Symbols used by the instance
@@ -443,6 +485,7 @@ private:
     std::vector<int> m_iparams;         ///< int param values
     std::vector<float> m_fparams;       ///< float param values
     std::vector<ustring> m_sparams;     ///< string param values
+    std::vector<ustring> m_interactive_params; ///< May change after opt
     int m_id;                           ///< Unique ID for the instance
     bool m_writes_globals;              ///< Do I have side effects?
     bool m_run_lazily;                  ///< OK to run this layer lazily?
@@ -458,6 +501,27 @@ private:
 
 
 
+/// What the first optimization pass made of one layer, so that an
+/// identical layer in another group (the same master, parameter values
+/// and neighboring layers) can reuse it instead of doing it all again.
+struct SpecializedInstance {
+    OpcodeVec ops;
+    std::vector<int> args;
+    SymbolVec symbols;                  ///< Instance values need rebinding
+    std::vector<int> iparams;
+    std::vector<float> fparams;
+    std::vector<ustring> sparams;
+    std::vector<int> connections;       ///< Indices of surviving connections
+    int maincodebegin, maincodeend;
+    bool outgoing_connections;
+    int next_newconst;                  ///< Past the $newconst names used
+};
+
+typedef shared_ptr<SpecializedInstance> SpecializedInstanceRef;
+
+
+
+
 /// Macro to loop over just the params & output params of an instance,
 /// with each iteration providing a Symbol& to symbolref.  Use like this:
 ///        FOREACH_PARAM (Symbol &s, inst) { ... stuff with s... }
@@ -467,6 +531,43 @@ private:
 
 
 
+/// What one optimization pass (ours or LLVM's) did, summed over every
+/// time it ran, for the "pass_stats" statistics.
+struct PassStats {
+    std::string name;
+    double time;                        ///< Total time spent in the pass
+    long long runs;                     ///< Number of times it ran
+    long long changes;                  ///< Ops changed, or syms/insts removed
+    PassStats (const std::string &name="")
+        : name(name), time(0), runs(0), changes(0) { }
+};
+
+typedef std::vector<PassStats> PassStatsVec;
+
+/// Add one or more runs of the named pass to its entry in stats,
+/// appending an entry (so the passes stay in the order they first ran)
+/// if it has none yet.
+void add_pass_stats (PassStatsVec &stats, const std::string &name,
+                     double time, long long changes, long long runs=1);
+
+
+
+/// The compiled code of the groups that share one set of optimized
+/// instances (see ShadingSystemImpl::adopt_equivalent_group).
+struct SharedGroupCode {
+    SharedGroupCode () : func(NULL), tier(0) { }
+    RunLLVMGroupFunc func;           ///< The code
+    LLVMJitMemoryRef jitmem;         ///< Holds func's code
+    int tier;                        ///< Tier of func
+};
+typedef shared_ptr<SharedGroupCode> SharedGroupCodeRef;
+
+/// Count of the points that ran a group.  Contexts hold on to it while
+/// they add up points, so it may outlive the group.
+typedef shared_ptr<atomic_ll> ExecutionCountRef;
+
+
+
 /// A ShaderGroup consists of one or more layers (each of which is a
 /// ShaderInstance), and the connections among them.
 class ShaderGroup {
@@ -475,9 +576,11 @@ public:
     ShaderGroup (const ShaderGroup &g);
     ~ShaderGroup ();
 
-    /// Clear the layers
-    ///
-    void clear () { m_layers.clear ();  m_optimized = 0;  m_executions = 0; }
+    /// Clear the layers (first abandoning any background compile of the
+    /// group, or waiting for one that's already running).  The compiled
+    /// code isn't freed right away, as other threads may be running it;
+    /// see ShadingSystemImpl::retire_llvm_jit_memory.
+    void clear ();
 
     /// Append a new shader instance on to the end of this group
     ///
@@ -507,6 +610,24 @@ public:
         m_llvm_compiled_version = func;
     }
 
+    /// Hold on to the JIT memory containing code this group may run; it
+    /// is freed when no group needs it any more.  A recompiled group
+    /// keeps its earlier code, too, since other threads may still be
+    /// running it.
+    void add_llvm_jit_memory (const LLVMJitMemoryRef &mem) {
+        m_llvm_jit_memory.push_back (mem);
+    }
+    LLVMJitMemoryRef llvm_jit_memory () const {
+        return m_llvm_jit_memory.size() ? m_llvm_jit_memory.back()
+                                        : LLVMJitMemoryRef();
+    }
+
+    /// Does the compiled code itself zero the parts of the group data
+    /// that could be read before being written (so that with
+    /// "clearmemory" the context needn't clear all of it)?
+    bool inits_groupdata () const { return m_inits_groupdata; }
+    void inits_groupdata (bool init) { m_inits_groupdata = init; }
+
     /// Is this shader group equivalent to ret void?
     bool does_nothing() const {
         return m_does_nothing;
@@ -515,27 +636,151 @@ public:
         m_does_nothing = new_val;
     }
 
-    long long int executions () const { return m_executions; }
-
-    void start_running () {
-#ifdef DEBUG
-       m_executions++;
-#endif
+    /// Optimization tier of the group: 0 if it's optimized without
+    /// constant folding and compiled with the quick LLVM pass list, and
+    /// should be replaced by a fully optimized copy once it has run
+    /// enough points, 1 if it's fully optimized.
+    int tier () const { return m_tier; }
+    void tier (int t) { m_tier = t; }
+
+    /// The fully optimized copy of a first-tier group, to run in its
+    /// place, or NULL if there isn't one (yet).
+    ShaderGroup *tiered_up () const { return m_tier_up_ptr; }
+
+    /// The ray types (bits of ShaderGlobals::raytype) this group is
+    /// specialized for, or -1 if it may be run for any ray.
+    int raytype () const { return m_raytype; }
+
+    /// Does this group compute derivatives?  If not, it's a variant in
+    /// which all derivatives are taken to be zero.
+    bool derivs () const { return m_derivs; }
+
+    /// The output params (as "param" or "layer.param") that the
+    /// renderer said it will read after running the group, or empty if
+    /// it didn't say, in which case every output is kept.
+    const std::vector<ustring> &renderer_outputs () const {
+        return m_renderer_outputs;
+    }
+    void renderer_outputs (const std::vector<ustring> &outputs) {
+        m_renderer_outputs = outputs;
     }
 
+    /// Do any layers have interactive parameters (whose values aren't
+    /// folded into the code, and may be changed by ReParameter)?
+    bool interactive () const;
+
+    /// Change the value of an interactive parameter of the named layer,
+    /// in this group and in its unoptimized copies and variants.
+    /// Return false if the layer has no such interactive parameter.
+    bool reparameter (ustring layername, ustring paramname,
+                      TypeDesc t, const void *val);
+
+    /// JIT cache key of the group, if it was computed, so that a later
+    /// recompile can still store to the cache.
+    const std::string &jitcache_key () const { return m_jitcache_key; }
+    void jitcache_key (const std::string &key) { m_jitcache_key = key; }
+
+    /// Number of points that ran the group, as far as the contexts have
+    /// reported them (see ShadingContext::flush_execution_count).
+    long long int executions () const { return *m_executions; }
+    const ExecutionCountRef &execution_count () const { return m_executions; }
+
 private:
     std::vector<ShaderInstanceRef> m_layers;
     RunLLVMGroupFunc m_llvm_compiled_version;
+    std::vector<LLVMJitMemoryRef> m_llvm_jit_memory; ///< Code we may run
     size_t m_llvm_groupdata_size;
     volatile int m_optimized;        ///< Is it already optimized?
     bool m_does_nothing;             ///< Is the shading group just func() { return; }
-    atomic_ll m_executions;          ///< Number of times the group executed
+    bool m_inits_groupdata;          ///< Code zeroes group data it must
+    bool m_compile_queued;           ///< Queued for background compile?
+    bool m_compile_running;          ///< Being compiled in background?
+    ShadingSystemImpl *m_compile_owner; ///< Who has our compile request
+    int m_tier;                      ///< Optimization tier of the code
+    int m_raytype;                   ///< Ray types specialized for, or -1
+    bool m_derivs;                   ///< Computes derivatives?
+    std::vector<ustring> m_renderer_outputs; ///< Outputs to keep
+    std::string m_jitcache_key;      ///< JIT cache key (if any)
+    std::vector<ShaderInstanceRef> m_pristine_layers; ///< Unoptimized copies
+    std::vector<shared_ptr<ShaderGroup> > m_variants; ///< Specialized
+    shared_ptr<ShaderGroup> m_tier_up; ///< Fully optimized copy
+    ShaderGroup * volatile m_tier_up_ptr; ///< m_tier_up, once it's ready
+    SharedGroupCodeRef m_shared_code; ///< Code shared with equivalents
+    spin_mutex m_variants_mutex;     ///< Guards m_variants, m_tier_up
+    ExecutionCountRef m_executions;  ///< Number of times the group executed
     mutex m_mutex;                   ///< Thread-safe optimization
     friend class ShadingSystemImpl;
 };
 
 
 
+/// The JIT code of one compiled group.  Every group's code is carved out
+/// of the ShadingSystem's one JITMemoryManager -- a DefaultJITMemoryManager
+/// grabs its code, data and stub slabs (about 0.5 MB) up front, too much
+/// to spend on each group, recompile and variant.  This remembers which
+/// function bodies and exception tables are the group's, and hands them
+/// back to the shared manager when the last group running the code lets
+/// go of it.  (The ExecutionEngine is deleted right after JITing, so it's
+/// never told to free anything.)  The few bytes of stubs and globals the
+/// JIT asks for aren't tracked, and stay in the shared slabs.
+class LLVMJitMemory {
+public:
+    LLVMJitMemory (ShadingSystemImpl &shadingsys);
+    ~LLVMJitMemory ();
+
+    ShadingSystemImpl &shadingsys () const { return m_shadingsys; }
+
+    /// The shared memory manager we allocate from.
+    llvm::JITMemoryManager *mm () const;
+
+    /// Note the blocks the JIT has emitted into, so we can free them.
+    void add_function (void *start, size_t size);
+    void add_exception_table (void *start, size_t size);
+
+    /// Recount the memory held, after JITing into it, for the stats.
+    void update_size ();
+
+private:
+    ShadingSystemImpl &m_shadingsys;
+    std::vector<void *> m_functions;        ///< Function bodies
+    std::vector<void *> m_exception_tables; ///< Exception tables
+    off_t m_bytes;                      ///< Bytes in all those blocks
+    off_t m_size;                       ///< Bytes we've counted as live
+};
+
+
+
+/// All the LLVM machinery needed to JIT one shader group at a time: a
+/// context, the parsed shadeop library living in that context, and the
+/// module, engine and JIT memory for the group currently being
+/// compiled.  An LLVMContext may only be used by one thread at a time,
+/// so the ShadingSystemImpl keeps a pool of these and each thread that
+/// needs to JIT a group checks one out for the duration, letting
+/// independent groups compile in parallel.
+struct LLVMJitState {
+    LLVMJitState () : context(NULL), module(NULL), ops_module(NULL),
+                      exec(NULL) { }
+    llvm::LLVMContext *context;
+    llvm::Module *module;               ///< Module of the group being JITed
+    llvm::Module *ops_module;           ///< Parsed ops, cloned per group
+    llvm::ExecutionEngine *exec;        ///< Engine for the current module
+    LLVMJitMemoryRef jitmem;            ///< Memory for the current module
+};
+
+
+
+/// Holds ShadingSystemImpl::llvm_jit_mutex while in scope, and adds the
+/// time spent waiting for it to wait_time, so that the optimizer's
+/// locking time includes it.
+class LLVMJitLock {
+public:
+    LLVMJitLock (double &wait_time);
+private:
+    boost::unique_lock<mutex> m_lock;
+};
+
+
+
 class ClosureRegistry {
 public:
 
@@ -571,6 +816,10 @@ public:
 
     bool empty () const { return m_closure_table.empty(); }
 
+    /// Number of registered closures (ids run from 0 to size()-1).
+    ///
+    size_t size () const { return m_closure_table.size(); }
+
 private:
 
 
@@ -595,6 +844,10 @@ public:
     virtual bool getattribute (const std::string &name, TypeDesc type, void *val);
 
     virtual bool Parameter (const char *name, TypeDesc t, const void *val);
+    virtual bool InteractiveParameter (const char *name, TypeDesc t,
+                                       const void *val);
+    virtual bool ConstantUserdata (const char *name, TypeDesc t,
+                                   const void *val);
     virtual bool Shader (const char *shaderusage,
                          const char *shadername=NULL,
                          const char *layername=NULL);
@@ -604,6 +857,10 @@ public:
                                  const char *dstlayer, const char *dstparam);
     virtual ShadingAttribStateRef state () const;
     virtual void clear_state ();
+    virtual bool bake (ShadingAttribStateRef &attribstate);
+    virtual bool ReParameter (ShadingAttribStateRef &attribstate,
+                              const char *layername, const char *paramname,
+                              TypeDesc t, const void *val);
 
 //    virtual void RunShaders (ShadingAttribStateRef &attribstate,
 //                             ShaderUse use);
@@ -642,8 +899,9 @@ public:
     ///
     ShadingContext *get_context (void* thread_info = NULL);
 
-    /// Return a ShadingContext to the pool.
-    ///
+    /// Return a ShadingContext to the pool.  The code of groups that
+    /// were cleared while contexts were checked out is only freed once
+    /// they have all been returned.
     void release_context (ShadingContext *sc, void* thread_info = NULL);
 
     void operator delete (void *todel) { ::delete ((char *)todel); }
@@ -673,17 +931,157 @@ public:
 
     ustring commonspace_synonym () const { return m_commonspace_synonym; }
 
+    /// Directory for the persistent cache of compiled groups, or the
+    /// empty string if the JIT cache is disabled.
+    const std::string &cachedir () const { return m_cachedir; }
+
+    /// Should we tell profilers (via /tmp/perf-<pid>.map) where the
+    /// JITed code for each group and layer lives?
+    bool perf_map () const { return m_perf_map; }
+
+    /// Append one line to the perf symbol map.
+    ///
+    void perf_map_add (const void *code, size_t size, const std::string &name);
+
     /// The group is set and won't be changed again; take advantage of
     /// this by optimizing the code knowing all our instance parameters
     /// (at least the ones that can't be overridden by the geometry).
     void optimize_group (ShadingAttribState &attribstate, ShaderGroup &group);
 
+    /// Set the params of the group's layers that would get the
+    /// attribute state's constant userdata as they run to that data,
+    /// unless we've already specialized max_userdata_groups groups.
+    void fold_constant_userdata (ShadingAttribState &attribstate,
+                                 ShaderGroup &group);
+
+    /// Queue the group to be optimized by the background compile
+    /// threads (starting them if needed), unless it's already queued,
+    /// and return immediately.  If the group (or its attribstate) is
+    /// cleared or destroyed first, the request is dropped.
+    void optimize_group_async (ShadingAttribState &attribstate,
+                               ShaderGroup &group);
+
+    /// Block until every group queued by optimize_group_async has been
+    /// optimized.
+    void wait_for_compiles ();
+
+    /// Drop any queued background compile of the group, and wait for
+    /// one that's already running to finish.  Called when the group is
+    /// about to be cleared or destroyed.
+    void cancel_compile (ShaderGroup &group);
+
+    /// Number of background compile threads to use, or 0 if groups are
+    /// optimized synchronously by the first thread to execute them.
+    int async_compile () const { return m_async_compile; }
+
+    /// Number of threads among which to split the per-layer cleanup
+    /// at the end of optimizing a group, or 0 to do it all serially.
+    int optimize_threads () const { return m_optimize_threads; }
+
+    /// Number of points a group must run before its quick first-tier
+    /// code is replaced by fully optimized code, or 0 if groups are
+    /// always fully optimized right away.
+    int tier_threshold () const { return m_tier_threshold; }
+
+    /// Replace a group's first-tier code with fully optimized code,
+    /// either right now or on a compile thread if we have them.
+    void request_recompile (ShaderGroup &group);
+
+    /// Make the fully optimized copy of a first-tier group that runs in
+    /// its place (see ShaderGroup::tiered_up).  If another thread is
+    /// already doing it, wait for that if wait is true, or else return
+    /// right away (leaving the first-tier code in place, for now) so
+    /// that render threads don't all stall on the hottest group.
+    void recompile_group (ShaderGroup &group, bool wait = false);
+
+    /// Share optimized groups among all identical groups?
+    ///
+    bool dedup_groups () const { return m_dedup_groups; }
+
+    /// Fold layers that are only run from one place into the code that
+    /// runs them, so the whole network is optimized as one function?
+    bool inline_layers () const { return m_inline_layers; }
+
+    /// Remember how each layer was specialized, so that identical
+    /// layers in other groups can skip straight to the result?
+    bool memoize_instances () const { return m_memoize_instances; }
+
+    /// Maximum number of groups to specialize for their constant
+    /// userdata (each is compiled separately), or 0 for no limit.
+    int max_userdata_groups () const { return m_max_userdata_groups; }
+
+    /// Time each optimization pass and count the changes it makes?
+    ///
+    bool pass_stats () const { return m_pass_stats; }
+
+    /// Add a RuntimeOptimizer's per-pass stats to our totals.
+    ///
+    void merge_pass_stats (const PassStatsVec &stats);
+
+    /// Maximum number of raytype-specialized variants per group (0 if
+    /// groups are not specialized by raytype).
+    int raytype_variants () const { return m_raytype_variants; }
+
+    /// Make derivative-free variants of groups, for the execute calls
+    /// that say they don't need derivatives?
+    bool noderivs_variants () const { return m_noderivs_variants; }
+
+    /// Return the variant of the (optimized) group specialized for
+    /// rays of the given raytype (-1 for any) and with or without
+    /// derivatives, creating and optimizing it if need be.  Return the
+    /// group itself if there's no such variant and we can't make one
+    /// (or with async compiles, until it's ready).
+    ShaderGroup *group_variant (ShadingAttribState &attribstate,
+                                ShaderGroup &group, int raytype, bool derivs);
+
+    /// If a group with the given fingerprint (as computed by
+    /// RuntimeOptimizer::jitcache_key) was already optimized and its
+    /// instances are still alive, make group use those instances and
+    /// that compiled code, and return true.
+    bool adopt_equivalent_group (const std::string &fingerprint,
+                                 ShaderGroup &group);
+
+    /// Remember the just-optimized group, so that identical groups can
+    /// adopt its instances and code.
+    void register_equivalent_group (const std::string &fingerprint,
+                                    ShaderGroup &group);
+
+    /// Return what a layer with the given key (as computed by
+    /// RuntimeOptimizer::specialization_key) was specialized into, or
+    /// an empty reference if we haven't seen such a layer.
+    SpecializedInstanceRef find_specialized_instance (const std::string &key);
+
+    /// Remember the specialization of a layer for find_specialized_instance.
+    ///
+    void register_specialized_instance (const std::string &key,
+                                        SpecializedInstanceRef spec);
+
     int *alloc_int_constants (size_t n) { return m_int_pool.alloc (n); }
     float *alloc_float_constants (size_t n) { return m_float_pool.alloc (n); }
     ustring *alloc_string_constants (size_t n) { return m_string_pool.alloc (n); }
 
-    llvm::LLVMContext *llvm_context () { return m_llvm_context; }
-    llvm::ExecutionEngine* ExecutionEngine () { return m_llvm_exec; }
+    /// Check out a set of LLVM state for this thread's exclusive use,
+    /// creating a new one if all existing ones are busy.
+    LLVMJitState *acquire_llvm_state ();
+
+    /// Return LLVM state obtained from acquire_llvm_state to the pool.
+    ///
+    void release_llvm_state (LLVMJitState *state);
+
+    /// Lock that serializes use of the (process-wide) JIT: creating and
+    /// deleting ExecutionEngines and generating machine code.
+    static mutex &llvm_jit_mutex ();
+
+    /// Called when the last reference to some JIT memory goes away.
+    /// Contexts that were already checked out may still be running the
+    /// code in it, so it's put aside, tagged with a new epoch, until all
+    /// of those have been released, then freed.  (Contexts checked out
+    /// later can't get to it.)
+    void retire_llvm_jit_memory (LLVMJitMemory *mem);
+
+    /// Free the retired JIT memory that no checked-out context can be
+    /// running.
+    void free_retired_llvm_jit_memory ();
 
     virtual void register_closure(const char *name, int id, const ClosureParam *params, int size,
                                   PrepareClosureFunc prepare, SetupClosureFunc setup, CompareClosureFunc compare);
@@ -712,6 +1110,33 @@ private:
     /// (This is a helper for ConnectShaders.)
     int find_named_layer_in_group (ustring layername, ShaderInstance * &inst);
 
+    /// Queue the group for a compile thread: a full optimization if
+    /// attribstate is non-NULL, otherwise a tier-up recompile.
+    void queue_compile (ShadingAttribState *attribstate, ShaderGroup &group);
+
+    /// Body of each background compile thread: optimize queued groups
+    /// until we're shut down.
+    void compile_thread_main ();
+
+    /// Stop the background compile threads, abandoning any groups that
+    /// haven't been started yet.
+    void stop_compile_threads ();
+
+    /// Run work on this thread while up to nhelpers of the persistent
+    /// optimize helper threads join in, returning once all are done.
+    /// work must be safe to run any number of times at once (helpers
+    /// that don't get to it before this thread finishes are called off).
+    void run_with_helpers (const boost::function<void()> &work,
+                           int nhelpers);
+
+    /// Body of each optimize helper thread: help with the work passed to
+    /// run_with_helpers until we're shut down.
+    void helper_thread_main ();
+
+    /// Stop the optimize helper threads.
+    ///
+    void stop_helper_threads ();
+
     /// Turn a connectionname (such as "Kd" or "Cout[1]", etc.) into a
     /// ConnectedParam descriptor.  This routine is strictly a helper for
     /// ConnectShaders, and will issue error messages on its behalf.
@@ -737,9 +1162,15 @@ private:
         return p;
     }
 
-    /// Set up LLVM -- make sure we have a Context, Module, ExecutionEngine,
-    /// retained JITMemoryManager, etc.
-    void SetupLLVM ();
+    /// Set up LLVM -- make sure the state has a Context, Module,
+    /// ExecutionEngine, retained JITMemoryManager, etc.  If bitcode is
+    /// non-NULL, the Module is parsed from it (a previously cached
+    /// group) rather than being a fresh copy of the shadeop library.
+    /// Return false (after reporting the error) if LLVM could not be
+    /// set up, in which case there's nothing to compile with.  Time
+    /// spent waiting for the JIT mutex is added to lock_time.
+    bool SetupLLVM (LLVMJitState &state, double &lock_time,
+                    llvm::MemoryBuffer *bitcode=NULL);
 
     RendererServices *m_renderer;         ///< Renderer services
     TextureSystem *m_texturesys;          ///< Texture system
@@ -749,8 +1180,18 @@ private:
     static const int m_errseenmax = 32;
     mutable mutex m_errmutex;
 
-    typedef std::map<ustring,ShaderMaster::ref> ShaderNameMap;
+    /// A loaded shader master, or a placeholder for one that some
+    /// thread is still loading.
+    struct MasterLoad {
+        ShaderMaster::ref master;         ///< The master (NULL if failed)
+        bool loading;                     ///< Still being loaded?
+        MasterLoad () : loading(true) { }
+    };
+    typedef std::map<ustring,MasterLoad> ShaderNameMap;
     ShaderNameMap m_shader_masters;       ///< name -> shader masters map
+    boost::mutex m_shader_masters_mutex;  ///< Guards m_shader_masters
+    boost::condition_variable m_shader_masters_cond; ///< A load finished
+    class MasterLoadGuard;                ///< Publishes a load's outcome
 
     ConstantPool<int> m_int_pool;
     ConstantPool<Float> m_float_pool;
@@ -762,6 +1203,7 @@ private:
     bool m_lazylayers;                    ///< Evaluate layers on demand?
     bool m_lazyglobals;                   ///< Run lazily even if globals write?
     bool m_clearmemory;                   ///< Zero mem before running shader?
+    bool m_clearmemory_partial;           ///< ...just what needs it, in code?
     bool m_rebind;                        ///< Allow rebinding?
     bool m_debugnan;                      ///< Root out NaN's?
     bool m_lockgeom_default;              ///< Default value of lockgeom
@@ -771,10 +1213,26 @@ private:
     std::vector<std::string> m_searchpath_dirs; ///< All searchpath dirs
     ustring m_commonspace_synonym;        ///< Synonym for "common" space
     std::vector<ustring> m_raytypes;      ///< Names of ray types
+    std::vector<ustring> m_renderer_outputs; ///< For groups declared next
+    int m_async_compile;                  ///< Background compile threads
+    int m_optimize_threads;               ///< Threads to finish layers
+    int m_tier_threshold;                 ///< Points to run before tier-up
+    bool m_dedup_groups;                  ///< Share identical groups?
+    bool m_inline_layers;                 ///< Inline layers into callers?
+    bool m_memoize_instances;             ///< Reuse layer specializations?
+    int m_max_userdata_groups;            ///< Max groups folding userdata
+    bool m_pass_stats;                    ///< Collect per-pass stats?
+    int m_raytype_variants;               ///< Max raytype variants/group
+    bool m_noderivs_variants;             ///< Make no-derivs variants?
+    std::string m_cachedir;               ///< JIT cache directory
+    bool m_perf_map;                      ///< Write a perf symbol map?
+    FILE *m_perf_map_file;                ///< Open perf map (or NULL)
+    mutex m_perf_map_mutex;               ///< Guards m_perf_map_file
 
     bool m_in_group;                      ///< Are we specifying a group?
     ShaderUse m_group_use;                ///< Use of group
     ParamValueList m_pending_params;      ///< Pending Parameter() values
+    std::vector<ustring> m_pending_interactive; ///< ...which are interactive
     ShadingAttribStateRef m_curattrib;    ///< Current shading attribute state
     std::map<ustring,int> m_global_heap_offsets; ///< Heap offsets of globals
     size_t m_global_heap_total;           ///< Heap size for globals
@@ -784,6 +1242,9 @@ private:
     // Stats
     atomic_int m_stat_shaders_loaded;     ///< Stat: shaders loaded
     atomic_int m_stat_shaders_requested;  ///< Stat: shaders requested
+    double m_stat_master_parse_time;      ///< Stat: time parsing .oso files
+    double m_stat_master_parse_max;       ///<   slowest single parse
+    ustring m_stat_master_parse_slowest;  ///<   ...and which file it was
     PeakCounter<int> m_stat_instances;    ///< Stat: instances
     PeakCounter<int> m_stat_contexts;     ///< Stat: shading contexts
     int m_stat_groups;                    ///< Stat: shading groups
@@ -807,6 +1268,40 @@ private:
     double m_stat_llvm_irgen_time;        ///<     llvm IR generation time
     double m_stat_llvm_opt_time;          ///<     llvm IR optimization time
     double m_stat_llvm_jit_time;          ///<     llvm JIT time 
+    double m_stat_llvm_ops_parse_time;    ///< Stat: time to parse the ops
+    double m_stat_llvm_ops_clone_time;    ///< Stat: time cloning the ops
+    int m_stat_llvm_ops_parses;           ///< Stat: parses of the ops bitcode
+    int m_stat_llvm_ops_clones;           ///< Stat: clones of the ops module
+    int m_stat_jitcache_hits;             ///< Stat: groups loaded from cache
+    int m_stat_jitcache_misses;           ///< Stat: groups not in cache
+    int m_stat_jitcache_stores;           ///< Stat: groups written to cache
+    int m_stat_jitcache_uncacheable;      ///< Stat: groups we can't cache
+    int m_stat_groups_compiled;           ///< Stat: groups JITed
+    int m_stat_async_compiles;            ///< Stat: groups compiled async
+    atomic_ll m_stat_deferred_executions; ///< Stat: execs awaiting compile
+    int m_stat_tier_recompiles;           ///< Stat: hot groups recompiled
+    double m_stat_tier_recompile_time;    ///< Stat: time recompiling
+    int m_stat_dedup_hits;                ///< Stat: groups shared
+    int m_stat_dedup_misses;              ///< Stat: groups not shared
+    long long m_stat_dedup_mem_saved;     ///< Stat: inst memory not duped
+    int m_stat_groupdata_groups;          ///< Stat: groups laid out
+    int m_stat_groupdata_layers;          ///< Stat: ... and their layers
+    long long m_stat_groupdata_size;      ///< Stat: total group data size
+    long long m_stat_groupdata_hot_size;  ///< Stat: ... used by the code
+    long long m_stat_groupdata_max;       ///< Stat: largest group data
+    int m_stat_cse_ops;                   ///< Stat: ops reusing results
+    long long m_stat_preopt_syms;         ///< Stat: symbols before opt
+    long long m_stat_postopt_syms;        ///< Stat: symbols after opt
+    long long m_stat_preopt_ops;          ///< Stat: ops before opt
+    long long m_stat_postopt_ops;         ///< Stat: ops after opt
+    int m_stat_instance_memo_hits;        ///< Stat: layers not re-specialized
+    int m_stat_instance_memo_misses;      ///< Stat: layers specialized
+    int m_stat_userdata_groups;           ///< Stat: groups folding userdata
+    int m_stat_userdata_params;           ///< Stat: ... params folded
+    PassStatsVec m_stat_passes;           ///< Stat: per optimization pass
+    int m_stat_group_variants;            ///< Stat: group variants made
+    atomic_ll m_stat_group_variant_points; ///< Stat: points they ran
+    double m_stat_jitcache_load_time;     ///< Stat: time loading from cache
 
     PeakCounter<off_t> m_stat_memory;     ///< Stat: all shading system memory
 
@@ -822,17 +1317,75 @@ private:
     PeakCounter<off_t> m_stat_mem_inst_syms;
     PeakCounter<off_t> m_stat_mem_inst_paramvals;
     PeakCounter<off_t> m_stat_mem_inst_connections;
+    PeakCounter<off_t> m_stat_mem_jit;    ///< Stat: live JIT memory
+    long long m_stat_mem_jit_freed;       ///< Stat: JIT memory freed
 
     spin_mutex m_stat_mutex;              ///< Mutex for non-atomic stats
     ClosureRegistry m_closure_registry;
 
+    // Background compilation
+    struct CompileRequest {
+        ShadingAttribState *attribstate;  ///< NULL means recompile
+        ShaderGroup *group;
+    };
+    std::deque<CompileRequest> m_compile_queue; ///< Groups awaiting compile
+    int m_compile_pending;                ///< Queued + in progress
+    bool m_compile_shutdown;              ///< Tell compile threads to exit
+    boost::mutex m_compile_mutex;         ///< Guards the compile queue
+    boost::condition_variable m_compile_cond;      ///< Queue not empty
+    boost::condition_variable m_compile_done_cond; ///< A compile finished
+    boost::thread_group m_compile_threads;
+    int m_ncompile_threads;               ///< Threads started so far
+
+    // Threads that help optimize_group finish the layers of big groups,
+    // kept around rather than started for each group
+    struct HelperJob {
+        boost::function<void()> work;
+        int running;                      ///< Helpers working on it
+    };
+    std::deque<HelperJob *> m_helper_queue; ///< One entry per helper wanted
+    bool m_helper_shutdown;               ///< Tell helper threads to exit
+    boost::mutex m_helper_mutex;          ///< Guards the helper queue
+    boost::condition_variable m_helper_cond;      ///< Queue not empty
+    boost::condition_variable m_helper_done_cond; ///< A helper finished
+    boost::thread_group m_helper_threads;
+    int m_nhelper_threads;                ///< Threads started so far
+
+    // Already-optimized groups, by fingerprint, that identical groups
+    // may share.  We don't keep the instances alive just for this.
+    struct EquivalentGroup {
+        std::vector<std::tr1::weak_ptr<ShaderInstance> > layers;
+        std::tr1::weak_ptr<SharedGroupCode> code; ///< Their current code
+        size_t groupdata_size;
+        bool does_nothing;
+        bool inits_groupdata;
+        off_t mem;                        ///< Memory of the instances
+    };
+    typedef std::map<std::string,EquivalentGroup> EquivalentGroupMap;
+    EquivalentGroupMap m_equivalent_groups;
+    mutex m_equivalent_groups_mutex;      ///< Guards m_equivalent_groups
+
+    // How layers were specialized, by specialization key.  These live
+    // as long as the shading system, which is why it's optional.
+    typedef std::map<std::string,SpecializedInstanceRef> SpecializedInstanceMap;
+    SpecializedInstanceMap m_specialized_instances;
+    mutex m_specialized_instances_mutex;  ///< Guards m_specialized_instances
+    off_t m_specialized_instances_mem;    ///< Memory they hold
+
     // LLVM stuff
-    llvm::LLVMContext *m_llvm_context;
-    llvm::Module *m_llvm_module;
-    llvm::ExecutionEngine *m_llvm_exec;
-    llvm::JITMemoryManager *m_llvm_jitmm;
+    std::vector<LLVMJitState *> m_llvm_states;      ///< All LLVM states
+    std::vector<LLVMJitState *> m_llvm_free_states; ///< Not checked out
+    mutable mutex m_llvm_states_mutex;    ///< Guards the LLVM state pool
+    llvm::JITMemoryManager *m_llvm_jitmm; ///< Holds all groups' code
+    /// JIT memory awaiting free, in the order it was retired, with the
+    /// epoch each was retired in
+    std::vector<std::pair<long long,LLVMJitMemory *> > m_retired_jit_memory;
+    std::map<long long,int> m_context_epochs; ///< Contexts out, by epoch
+    long long m_jit_epoch;                ///< Retirements so far
+    spin_mutex m_jit_epoch_mutex;         ///< Guards the above
 
     friend class ShadingContext;
+    friend class LLVMJitMemory;
     friend class ShaderMaster;
     friend class ShaderInstance;
     friend class RuntimeOptimizer;
@@ -895,8 +1448,62 @@ public:
     /// Execute the shaders for the given use (for example,
     /// ShadUseSurface). If runflags are not supplied, they will be
     /// auto-generated with all points turned on.
+    /// If derivs is false, derivatives will be taken to be zero, which
+    /// (with the "noderivs_variants" attribute) lets the shaders be run
+    /// by a cheaper variant of the group that doesn't compute them.
     void execute (ShaderUse use, ShadingAttribState &sas,
-                  ShaderGlobals &ssg);
+                  ShaderGlobals &ssg, bool derivs = true);
+
+    /// Execute the shaders for the given use on each of the npoints
+    /// ShaderGlobals in the ssg array, amortizing the group lookup,
+    /// heap setup and closure pool reset over the whole batch.  Each
+    /// point gets its own slice of the heap, so after the call the
+    /// outputs of point i may be retrieved with symbol_data(sym,i),
+    /// and the closures of all points remain valid until the next
+    /// execute, execute_batch, or bind on this context.
+    void execute_batch (ShaderUse use, ShadingAttribState &sas,
+                        ShaderGlobals *ssg, int npoints, bool derivs = true);
+
+    /// Bind the context to a grid of npoints shading points (whose
+    /// globals are in the ssg array, which must remain valid until the
+    /// context is rebound) for the given use: optimize the group if
+    /// needed and set up heap space for all points.  Return true if
+    /// there is anything to execute.
+    bool bind (ShaderUse use, ShadingAttribState &sas,
+               ShaderGlobals *ssg, int npoints, bool derivs = true);
+
+    /// Execute the shaders of the given use on the points of the bound
+    /// grid.  If ind is supplied, run just the nind points it lists;
+    /// otherwise, if rf is supplied, run just the points whose runflag
+    /// is on; otherwise run all points.  Outputs for any point of the
+    /// grid may subsequently be retrieved with symbol_data().
+    void execute (ShaderUse use, Runflag *rf=NULL, int *ind=NULL, int nind=0) {
+        execute_llvm (use, rf, ind, nind);
+    }
+
+    /// Return the number of points in the bound grid.
+    ///
+    int npoints () const { return m_npoints; }
+
+    /// Did the last execute, execute_batch or bind do nothing because
+    /// the group is still being compiled in the background (see the
+    /// "async_compile" attribute)?  If so, the caller should defer the
+    /// points and try them again later.
+    bool compile_pending () const { return m_compile_pending; }
+
+    /// The JIT memory epoch when the context was checked out (see
+    /// ShadingSystemImpl::retire_llvm_jit_memory).
+    long long jit_epoch () const { return m_jit_epoch; }
+    void jit_epoch (long long epoch) { m_jit_epoch = epoch; }
+
+    /// Add the points this context ran since the last flush to the
+    /// execution count of their group, and let go of the count.
+    void flush_execution_count () {
+        if (m_counted_points)
+            *m_counted += m_counted_points;
+        m_counted.reset ();
+        m_counted_points = 0;
+    }
 
     /// Return the current shader use being executed.
     ///
@@ -975,9 +1582,13 @@ public:
     /// attribname is "", return the value of the node itself.
     int dict_value (int nodeID, ustring attribname, TypeDesc type, void *data);
 
-    /// Various setup of the context done by execute().  Return true if
-    /// the function should be executed, otherwise false.
-    bool prepare_execution (ShaderUse use, ShadingAttribState &sas);
+    /// Various setup of the context done by execute(), with heap space
+    /// for npoints shading points, all of the given raytype (-1 if they
+    /// aren't all the same), and which may or may not need derivs.
+    /// Return true if the function should be executed, otherwise false.
+    bool prepare_execution (ShaderUse use, ShadingAttribState &sas,
+                            int npoints = 1, int raytype = -1,
+                            bool derivs = true);
 private:
 
     /// Execute the llvm-compiled shaders for the given use (for example,
@@ -987,6 +1598,16 @@ private:
     void execute_llvm (ShaderUse use, Runflag *rf=NULL,
                        int *ind=NULL, int nind=0);
 
+    /// Run the compiled group on one point of the bound grid.
+    ///
+    void run_point (RunLLVMGroupFunc run_func, int i) {
+        ShaderGlobals &sg (m_sg[i]);
+        sg.context = this;
+        sg.Ci = NULL;
+        m_messages.clear ();
+        run_func (&sg, &m_heap[m_groupdata_size * i]);
+    }
+
     void free_dict_resources ();
 
     ShadingSystemImpl &m_shadingsys;    ///< Backpointer to shadingsys
@@ -995,6 +1616,14 @@ private:
     std::vector<char> m_heap;           ///< Heap memory
     size_t m_closures_allotted;         ///< Closure memory allotted
     int m_curuse;                       ///< Current use that we're running
+    ShaderGroup *m_group;               ///< Group (or variant) being run
+    ShaderGlobals *m_sg;                ///< Globals of the bound grid
+    int m_npoints;                      ///< Number of points in the grid
+    size_t m_groupdata_size;            ///< Heap stride between points
+    bool m_compile_pending;             ///< Deferred awaiting a compile
+    ExecutionCountRef m_counted;        ///< Execution count we're adding to
+    int m_counted_points;               ///< Points not yet added to it
+    long long m_jit_epoch;              ///< Epoch when checked out
 #ifdef OIIO_HAVE_BOOST_UNORDERED_MAP
     typedef boost::unordered_map<ustring, boost::regex*, ustringHash> RegexMap;
 #else
@@ -1022,7 +1651,12 @@ class ShadingAttribState
 public:
     ShadingAttribState () { }
 
-    ~ShadingAttribState () { }
+    ~ShadingAttribState () {
+        // Clear the groups before anything else goes away, so that a
+        // background compile of one can't outlive the state it uses.
+        for (int i = 0;  i < (int)OSL::pvt::ShadUseLast;  ++i)
+            m_shaders[i].clear ();
+    }
 
     /// Return a reference to the shader group for a particular use
     ///
@@ -1033,8 +1667,13 @@ public:
     /// Called when the shaders of the attrib state change (invalidate LLVM ?)
     void changed_shaders () { }
 
+    /// Userdata that the renderer says is constant for everything
+    /// using this state.
+    ParamValueList & constant_userdata () { return m_constant_userdata; }
+
 private:
     OSL::pvt::ShaderGroup m_shaders[OSL::pvt::ShadUseLast];
+    ParamValueList m_constant_userdata;
 };
 
 
@@ -40,21 +40,20 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string>
 
 #include "osoreader.h"
-
-#undef yylex
-#define yyFlexLexer osoFlexLexer
-#include "FlexLexer.h"
+#include "osolexer.h"
 
 using namespace OSL;
 using namespace OSL::pvt;
 
-void yyerror (const char *err);
-
-#define yylex OSOReader::osolexer->yylex
-#define reader OSOReader::reader
+// The parser is pure (reentrant): the reader and lexer for the file
+// being read are passed to osoparse, and every rule gets at them (and
+// at the little bit of state carried between rules) from there.
+#undef yylex
+#define yylex(lvalp,llocp) osolexer->lex (lvalp)
 
-static TypeSpec current_typespec;
-static std::string current_shader_name;
+struct YYLTYPE;
+void yyerror (YYLTYPE *loc, OSOReader *osoreader, OSOLexer *osolexer,
+              const char *err);
 
 // Forward declaration
 #ifdef OSL_NAMESPACE
@@ -84,6 +83,11 @@ TypeDesc lextype (int lex);
 // Tell Bison to track locations for improved error messages
 %locations
 
+// Make a reentrant parser, with no global state
+%pure-parser
+%parse-param { OSL::pvt::OSOReader *osoreader }
+%parse-param { OSOLexer *osolexer }
+
 
 // Define the terminal symbols.
 %token <s> IDENTIFIER STRING_LITERAL HINT
@@ -114,7 +118,7 @@ TypeDesc lextype (int lex);
 oso_file
         : version shader_declaration symbols_opt codemarker instructions
                 {
-                    OSOReader::osoreader->codeend ();
+                    osoreader->codeend ();
                     $$ = 0;
                 }
 	;
@@ -124,7 +128,7 @@ version
                 {
                     int major = (int) $2;
                     int minor = (int) (100*($2-major) + 0.5);
-                    OSOReader::osoreader->version ($1, major, minor);
+                    osoreader->version ($1, major, minor);
                     $$ = 0;
                 }
         ;
@@ -132,8 +136,8 @@ version
 shader_declaration
         : shader_type IDENTIFIER 
                 {
-                    OSOReader::osoreader->shader ($1, $2);
-                    current_shader_name = $2;
+                    osoreader->shader ($1, $2);
+                    osolexer->current_shader_name = $2;
                 }
             hints_opt ENDOFLINE
                 {
@@ -149,7 +153,7 @@ symbols_opt
 codemarker
         : CODE IDENTIFIER ENDOFLINE
                 {
-                    OSOReader::osoreader->codemarker ($2);
+                    osoreader->codemarker ($2);
                 }
         ;
 
@@ -161,11 +165,11 @@ instructions
 instruction
         : label opcode 
                 {
-                    OSOReader::osoreader->instruction ($1, $2);
+                    osoreader->instruction ($1, $2);
                 }
             arguments_opt jumptargets_opt hints_opt ENDOFLINE
                 {
-                    OSOReader::osoreader->instruction_end ();
+                    osoreader->instruction_end ();
                 }
         | codemarker
         | ENDOFLINE
@@ -183,10 +187,10 @@ symbols
 symbol
         : SYMTYPE typespec arraylen_opt IDENTIFIER 
                 {
-                    TypeSpec typespec = current_typespec;
+                    TypeSpec typespec = osolexer->current_typespec;
                     if ($3)
                         typespec.make_array ($3);
-                    OSOReader::osoreader->symbol ((SymType)$1, typespec, $4);
+                    osoreader->symbol ((SymType)$1, typespec, $4);
                 }
             initial_values_opt hints_opt ENDOFLINE
         | ENDOFLINE
@@ -196,19 +200,20 @@ symbol
 typespec
         : simple_typename
                 {
-                    current_typespec = lextype ($1);
+                    osolexer->current_typespec = lextype ($1);
                     $$ = 0;
                 }
         | CLOSURE simple_typename
                 {
-                    current_typespec = TypeSpec (lextype ($2), true);
+                    osolexer->current_typespec = TypeSpec (lextype ($2), true);
                     $$ = 0;
                 }
         | STRUCT IDENTIFIER
                 {
                     // Prepend the shader name to make globally unique
-                    std::string mangled = current_shader_name + "_" + $2;
-                    current_typespec = TypeSpec (mangled.c_str(), 0);
+                    std::string mangled = osolexer->current_shader_name
+                                          + "_" + $2;
+                    osolexer->current_typespec = TypeSpec (mangled.c_str(), 0);
                     $$ = 0;
                 }
         ;
@@ -243,17 +248,17 @@ initial_values
 initial_value
         : FLOAT_LITERAL
                 {
-                    OSOReader::osoreader->symdefault ($1);
+                    osoreader->symdefault ($1);
                     $$ = 0;
                 }
         | INT_LITERAL
                 {
-                    OSOReader::osoreader->symdefault ($1);
+                    osoreader->symdefault ($1);
                     $$ = 0;
                 }
         | STRING_LITERAL
                 {
-                    OSOReader::osoreader->symdefault ($1);
+                    osoreader->symdefault ($1);
                     $$ = 0;
                 }
         ;
@@ -280,7 +285,7 @@ arguments
 argument
         : IDENTIFIER
                 {
-                    OSOReader::osoreader->instruction_arg ($1);
+                    osoreader->instruction_arg ($1);
                 }
         ;
 
@@ -297,7 +302,7 @@ jumptargets
 jumptarget
         : INT_LITERAL
                 {
-                    OSOReader::osoreader->instruction_jump ($1);
+                    osoreader->instruction_jump ($1);
                 }
         ;
 
@@ -314,7 +319,7 @@ hints
 hint
         : HINT
                 {
-                    OSOReader::osoreader->hint ($1);
+                    osoreader->hint ($1);
                 }
         ;
 
@@ -323,12 +328,13 @@ hint
 
 
 void
-yyerror (const char *err)
+yyerror (YYLTYPE *loc, OSOReader *osoreader, OSOLexer *osolexer,
+         const char *err)
 {
 //    oslcompiler->error (oslcompiler->filename(), oslcompiler->lineno(),
 //                        "Syntax error: %s", err);
     fprintf (stderr, "Error, line %d: %s", 
-             OSOReader::osoreader->lineno(), err);
+             osoreader->lineno(), err);
 }
 
 
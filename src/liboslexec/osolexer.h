@@ -0,0 +1,86 @@
+/*
+Copyright (c) 2009-2010 Sony Pictures Imageworks Inc., et al.
+All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+* Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+* Neither the name of Sony Pictures Imageworks nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OSL_OSOLEXER_H
+#define OSL_OSOLEXER_H
+
+/// Internals shared by the .oso lexer, the .oso parser, and
+/// OSOReader::parse.  Nobody else should need to include this.
+
+#include <iostream>
+#include <string>
+
+#include "osoreader.h"
+
+// The flex-generated scanner has already included FlexLexer.h by the
+// time it sees this header; everybody else needs it here.
+#ifndef yyFlexLexerOnce
+#undef yyFlexLexer
+#define yyFlexLexer osoFlexLexer
+#include "FlexLexer.h"
+#endif
+
+union YYSTYPE;   // Defined by the bison-generated parser
+
+
+
+/// Lexer for one .oso file.  Everything the lexer and parser need while
+/// reading a file lives here (rather than in globals), so that separate
+/// threads may read separate files at the same time.
+class OSOLexer : public osoFlexLexer {
+public:
+    OSOLexer (std::istream *input, OSL::pvt::OSOReader &reader)
+        : osoFlexLexer (input), m_reader (reader), m_lval (NULL)
+    { }
+
+    /// Scan the next token, storing its value in *lval.  This is what
+    /// the parser calls.
+    int lex (YYSTYPE *lval) { m_lval = lval; return yylex (); }
+
+    /// The scanner proper, generated by flex.
+    int yylex ();
+
+    /// The reader whose callbacks the parser should call.
+    OSL::pvt::OSOReader &reader () const { return m_reader; }
+
+    // Bits of state the parser carries from one rule to the next.
+    OSL::pvt::TypeSpec current_typespec;  ///< Type of the current symbol
+    std::string current_shader_name;      ///< Name of the shader
+
+private:
+    OSL::pvt::OSOReader &m_reader;        ///< Reader being fed
+    YYSTYPE *m_lval;                      ///< Where to put token values
+};
+
+
+
+/// The bison-generated parser.  Return nonzero if there was an error.
+extern int osoparse (OSL::pvt::OSOReader *osoreader, OSOLexer *osolexer);
+
+
+#endif /* OSL_OSOLEXER_H */
@@ -32,16 +32,10 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cstdio>
 
 #include "osoreader.h"
-
-#define yyFlexLexer osoFlexLexer
-#include "FlexLexer.h"
+#include "osolexer.h"
 
 #include "OpenImageIO/strutil.h"
 #include "OpenImageIO/dassert.h"
-#include "OpenImageIO/thread.h"
-#ifdef OIIO_NAMESPACE
-using OIIO::lock_guard;
-#endif
 
 
 #ifdef OSL_NAMESPACE
@@ -51,37 +45,25 @@ namespace OSL {
 namespace pvt {   // OSL::pvt
 
 
-osoFlexLexer * OSOReader::osolexer = NULL;
-OSOReader * OSOReader::osoreader = NULL;
-mutex OSOReader::m_osoread_mutex;
-
-
-
 bool
 OSOReader::parse (const std::string &filename)
 {
-    // The lexer/parser isn't thread-safe, so make sure Only one thread
-    // can actually be reading a .oso file at a time.
-    lock_guard guard (m_osoread_mutex);
-
+    // All the lexer and parser state lives in the OSOLexer, so there's
+    // no need to keep other threads from reading other files meanwhile.
     std::fstream input (filename.c_str(), std::ios::in);
     if (! input.is_open()) {
         m_err.error ("File %s not found", filename.c_str());
         return false;
     }
 
-    osoreader = this;
-    osolexer = new osoFlexLexer (&input);
-    assert (osolexer);
-    bool ok = ! osoparse ();   // osoparse returns nonzero if error
+    m_lineno = 1;
+    OSOLexer lexer (&input, *this);
+    bool ok = ! osoparse (this, &lexer);   // osoparse returns nonzero if error
     if (ok) {
 //        m_err.info ("Correctly parsed %s", filename.c_str());
     } else {
         m_err.error ("Failed parse of %s", filename.c_str());
     }
-    delete osolexer;
-    osolexer = NULL;
-
     input.close ();
     return ok;
 }
@@ -31,16 +31,6 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "osl_pvt.h"
 
-#include "OpenImageIO/thread.h"
-#ifdef OIIO_NAMESPACE
-using OIIO::mutex;
-#endif
-
-
-
-class osoFlexLexer;
-extern int osoparse ();
-
 
 #ifdef OSL_NAMESPACE
 namespace OSL_NAMESPACE {
@@ -51,7 +41,9 @@ namespace pvt {
 
 
 /// Base class for OSO (OpenShadingLanguage object code) file reader.
-///
+/// Each reader carries its own parse state, so different threads may
+/// read different files at the same time (but any one reader should
+/// only be used by one thread at a time).
 class OSOReader {
 public:
     OSOReader (ErrorHandler *errhandler = NULL) 
@@ -126,17 +118,9 @@ public:
     /// be called by the lexer.
     int lineno () const { return m_lineno; }
 
-    /// Pointer to the one and only lexer in effect.  This is 'public',
-    /// but NOBODY should modify this except for this class and the
-    /// lexer internals.
-    static osoFlexLexer *osolexer;
-
-    static OSOReader *osoreader;
-
 private:
     ErrorHandler &m_err;
     int m_lineno;
-    static mutex m_osoread_mutex;
 };
 
 
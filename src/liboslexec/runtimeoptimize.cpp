@@ -27,11 +27,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <vector>
+#include <algorithm>
 #include <string>
 #include <cstdio>
 #include <cmath>
 
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
 
 #include <OpenImageIO/hash.h>
 #include <OpenImageIO/timer.h>
@@ -81,6 +83,54 @@ void erase_if (Container &c, const Predicate &p)
 
 
 
+namespace {
+
+/// Times one run of an optimization pass, if we're collecting per-pass
+/// stats, and adds it (and the changes it made) to the stats when it
+/// goes out of scope.  Use like this:
+///     { PassTimer t (rop, "peephole2");  changed += t.count (rop.peephole2 (opnum)); }
+class PassTimer {
+public:
+    PassTimer (RuntimeOptimizer &rop, const char *name)
+        : m_rop (rop), m_name (name), m_changes (0),
+          m_on (rop.shadingsys().pass_stats()), m_timer (m_on) { }
+    ~PassTimer () {
+        if (m_on)
+            m_rop.add_pass_stats (m_name, m_timer(), m_changes);
+    }
+    /// Note (and return) the number of changes the pass made.
+    int count (int changes) { m_changes += changes;  return changes; }
+private:
+    RuntimeOptimizer &m_rop;
+    const char *m_name;
+    long long m_changes;
+    bool m_on;
+    Timer m_timer;
+};
+
+};  // anon namespace
+
+
+
+void
+add_pass_stats (PassStatsVec &stats, const std::string &name,
+                double time, long long changes, long long runs)
+{
+    PassStatsVec::iterator p;
+    for (p = stats.begin();  p != stats.end();  ++p)
+        if (p->name == name)
+            break;
+    if (p == stats.end()) {
+        stats.push_back (PassStats (name));
+        p = stats.end() - 1;
+    }
+    p->time += time;
+    p->runs += runs;
+    p->changes += changes;
+}
+
+
+
 void
 RuntimeOptimizer::set_inst (int newlayer)
 {
@@ -1626,6 +1676,35 @@ typedef hash_map<ustring, OpFolder, ustringHash> FolderTable;
 
 static FolderTable folder_table;
 
+// Ops whose results eliminate_common_subexpressions may reuse
+#ifdef OIIO_HAVE_BOOST_UNORDERED_MAP
+typedef boost::unordered_map<ustring, bool, ustringHash> PureOpTable;
+#else
+typedef hash_map<ustring, bool, ustringHash> PureOpTable;
+#endif
+
+static PureOpTable pure_op_table;
+
+DECLFOLDER(constfold_raytype)
+{
+    // Try to turn R=raytype(name) into R=C, if the group is a variant
+    // specialized for a particular raytype.
+    int raytype = rop.group().raytype();
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol &Name (*rop.inst()->argsymbol(op.firstarg()+1));
+    if (raytype >= 0 && Name.is_constant()) {
+        ASSERT (Name.typespec().is_string());
+        int bit = rop.shadingsys().raytype_bit (*(ustring *)Name.data());
+        int result = (raytype & bit) != 0;
+        int cind = rop.add_constant (TypeDesc::TypeInt, &result);
+        rop.turn_into_assign (op, cind);
+        return 1;
+    }
+    return 0;
+}
+
+
+
 void
 initialize_folder_table ()
 {
@@ -1672,12 +1751,44 @@ initialize_folder_table ()
     INIT (getmessage);
     INIT (gettextureinfo);
     INIT (useparam);
+    INIT (raytype);
 //    INIT (assign);  N.B. do not include here -- we want this run AFTER
 //                    all other constant folding is done, since many of
 //                    them turn other statements into assignments.
 #undef INIT
 #undef INIT2
 
+    // Ops that compute their results from nothing but their arguments
+    // (and the shader globals, which don't change while a shader runs),
+    // and have no other effects, so that two of them with the same
+    // arguments must give the same results.  Ops that write more than
+    // their first argument are never reused, even if they're listed.
+    // (Texture lookups aren't here: they go to the renderer's texture
+    // system, which may report errors and keep stats as they happen.)
+    static const char *pure_ops[] = {
+        "add", "sub", "mul", "div", "mod", "neg", "abs", "fabs", "fmod",
+        "eq", "neq", "le", "ge", "lt", "gt", "and", "or",
+        "bitand", "bitor", "xor", "compl", "shl", "shr",
+        "sqrt", "inversesqrt", "pow", "exp", "exp2", "expm1",
+        "log", "log2", "log10", "logb", "sin", "cos", "tan",
+        "asin", "acos", "atan", "atan2", "sinh", "cosh", "tanh",
+        "hypot", "erf", "erfc", "radians", "degrees",
+        "floor", "ceil", "round", "trunc", "sign",
+        "isnan", "isinf", "isfinite", "min", "max", "clamp", "mix",
+        "step", "smoothstep", "spline",
+        "dot", "cross", "length", "distance", "normalize", "luminance",
+        "reflect", "refract", "determinant", "transpose",
+        "color", "point", "vector", "normal", "matrix",
+        "transform", "transformv", "transformn",
+        "compref", "aref", "mxcompref", "arraylength",
+        "strlen", "concat", "substr", "startswith", "endswith",
+        "Dx", "Dy", "area", "filterwidth", "calculatenormal",
+        "noise", "snoise", "pnoise", "psnoise", "cellnoise",
+        NULL
+    };
+    for (const char **name = pure_ops;  *name;  ++name)
+        pure_op_table[ustring(*name)] = true;
+
     folder_table_initialized = true;
 }
 
@@ -1736,6 +1847,8 @@ RuntimeOptimizer::find_constant_params (ShaderGroup &group)
         Symbol *s (inst()->symbol(i));
         if (// it's a paramter that can't change with the geom
             s->symtype() == SymTypeParam && s->lockgeom() &&
+            // and the renderer won't change it after we compile
+            ! s->interactive() &&
             // and it's NOT a default val that needs to run init ops
             !(s->valuesource() == Symbol::DefaultVal && s->has_init_ops()) &&
             // and it not a structure or closure variable...
@@ -1750,7 +1863,7 @@ RuntimeOptimizer::find_constant_params (ShaderGroup &group)
                 BOOST_FOREACH (Connection &c, inst()->connections()) {
                     if (c.dst.param == i) {
                         Symbol *srcsym = group[c.srclayer]->symbol(c.src.param);
-                        if (!srcsym->everused() &&
+                        if (!srcsym->everused() && !srcsym->interactive() &&
                             (srcsym->valuesource() == Symbol::DefaultVal ||
                              srcsym->valuesource() == Symbol::InstanceVal) &&
                             !srcsym->has_init_ops()) {
@@ -2052,7 +2165,8 @@ RuntimeOptimizer::useless_op_elision (Opcode &op)
                 writes_something = true;
                 Symbol *A (inst()->argsymbol(op.firstarg()+a));
                 bool local_or_tmp = (A->symtype() == SymTypeLocal ||
-                                     A->symtype() == SymTypeTemp);
+                                     A->symtype() == SymTypeTemp ||
+                                     unneeded_output (*A));
                 if (A->everread() || ! local_or_tmp)
                     noeffect = false;
             }
@@ -2227,6 +2341,112 @@ RuntimeOptimizer::peephole2 (int opnum)
 
 
 
+namespace {
+
+/// A result that's still available in the current basic block: sym
+/// holds the result of op applied to args.
+struct AvailableValue {
+    ustring op;
+    std::vector<int> args;
+    int sym;
+    bool uses (int s) const {
+        return sym == s || std::find (args.begin(), args.end(), s) != args.end();
+    }
+};
+
+};  // anon namespace
+
+
+
+int
+RuntimeOptimizer::eliminate_common_subexpressions ()
+{
+    int changed = 0;
+    OpcodeVec &code (inst()->ops());
+    std::vector<AvailableValue> available;
+    std::vector<int> args;
+    // The folding loop has already rewritten the args through the block
+    // and global aliases; this also sees through the copies we make
+    // ourselves, so later uses of a copy still match (R -> original).
+    std::map<int,int> copies;
+    find_basic_blocks ();
+    int lastblock = -1;
+    for (int opnum = 0;  opnum < (int)code.size();  ++opnum) {
+        Opcode &op (code[opnum]);
+        if (lastblock != m_bblockids[opnum]) {
+            available.clear ();
+            copies.clear ();
+            lastblock = m_bblockids[opnum];
+        }
+        if (op.opname() == u_nop)
+            continue;
+
+        // Is it a pure op that writes only its first arg, which it
+        // doesn't also read?  (Leave closures and aggregates alone.)
+        bool pure = (op.nargs() >= 1 && op.argwrite(0) && ! op.argread(0) &&
+                     pure_op_table.find (op.opname()) != pure_op_table.end());
+        int R = pure ? inst()->arg(op.firstarg()) : -1;
+        if (pure) {
+            const TypeSpec &t (inst()->symbol(R)->typespec());
+            pure = ! (t.is_closure() || t.is_structure() || t.is_array());
+        }
+        args.clear ();
+        for (int a = 1;  pure && a < op.nargs();  ++a) {
+            int s = inst()->arg(op.firstarg()+a);
+            pure = (! op.argwrite(a) && s != R);
+            std::map<int,int>::const_iterator c = copies.find (s);
+            args.push_back (c != copies.end() ? c->second : s);
+        }
+
+        // If an earlier op in the block computed the same thing, and
+        // neither its arguments nor its result have been written since,
+        // just copy its result.
+        int replaced = -1;
+        for (size_t i = 0;  pure && i < available.size();  ++i) {
+            const AvailableValue &v (available[i]);
+            if (v.op == op.opname() && v.args == args &&
+                  inst()->symbol(v.sym)->typespec() == inst()->symbol(R)->typespec()) {
+                turn_into_assign (op, v.sym);
+                replaced = v.sym;
+                ++changed;
+                break;
+            }
+        }
+
+        // Anything this op writes invalidates the results computed
+        // from it, any result it overwrites, and copies of either.
+        for (int a = 0;  a < op.nargs();  ++a) {
+            if (! op.argwrite(a))
+                continue;
+            int s = inst()->arg(op.firstarg()+a);
+            for (size_t i = 0;  i < available.size();  )
+                if (available[i].uses (s))
+                    available.erase (available.begin()+i);
+                else
+                    ++i;
+            for (std::map<int,int>::iterator c = copies.begin();
+                   c != copies.end();  )
+                if (c->first == s || c->second == s)
+                    copies.erase (c++);
+                else
+                    ++c;
+        }
+
+        if (replaced >= 0)
+            copies[R] = replaced;
+        else if (pure) {
+            available.resize (available.size()+1);
+            available.back().op = op.opname();
+            available.back().args.swap (args);
+            available.back().sym = R;
+        }
+    }
+    m_stat_cse_ops += changed;
+    return changed;
+}
+
+
+
 /// Mark our params that feed to later layers, and whether we have any
 /// outgoing connections.
 void
@@ -2246,16 +2466,46 @@ RuntimeOptimizer::mark_outgoing_connections ()
 
 
 
+bool
+RuntimeOptimizer::unneeded_output (const Symbol &s) const
+{
+    const std::vector<ustring> &outputs (m_group.renderer_outputs());
+    if (outputs.empty() || s.symtype() != SymTypeOutputParam ||
+            s.connected_down())
+        return false;
+    const std::string &layer (inst()->layername().string());
+    BOOST_FOREACH (ustring name, outputs) {
+        if (name == s.name())
+            return false;
+        // Also accept "layer.param"
+        if (name.size() == layer.size() + 1 + s.name().size() &&
+                ! name.string().compare (0, layer.size(), layer) &&
+                name[layer.size()] == '.' &&
+                ! name.string().compare (layer.size()+1, std::string::npos,
+                                         s.name().string()))
+            return false;
+    }
+    return true;
+}
+
+
+
 void
 RuntimeOptimizer::optimize_instance ()
 {
+    // If the renderer said which outputs it wants, we need to know
+    // from the start which of our outputs later layers use, so we
+    // don't throw those away along with the unwanted ones.
+    if (m_group.renderer_outputs().size())
+        mark_outgoing_connections ();
+
     // Make a list of the indices of all constants.
     for (int i = 0;  i < (int)inst()->symbols().size();  ++i)
         if (inst()->symbol(i)->symtype() == SymTypeConst)
             m_all_consts.push_back (i);
 
     // Turn all geom-locked parameters into constants.
-    if (m_shadingsys.optimize() >= 2) {
+    if (optimize() >= 2) {
         find_constant_params (group());
     }
 
@@ -2327,10 +2577,12 @@ RuntimeOptimizer::optimize_instance ()
 
             // For various ops that we know how to effectively
             // constant-fold, dispatch to the appropriate routine.
-            if (m_shadingsys.optimize() >= 2) {
+            if (optimize() >= 2) {
                 FolderTable::const_iterator found = folder_table.find (op.opname());
-                if (found != folder_table.end())
-                    changed += (*found->second) (*this, opnum);
+                if (found != folder_table.end()) {
+                    PassTimer t (*this, "constant folding");
+                    changed += t.count ((*found->second) (*this, opnum));
+                }
             }
 
             // Clear local block aliases for any args that were written
@@ -2340,7 +2592,7 @@ RuntimeOptimizer::optimize_instance ()
                     block_unalias (inst()->arg(op.firstarg()+i));
 
             // Get rid of an 'if' if it contains no statements to execute
-            if (m_shadingsys.optimize() >= 2 && op.opname() == u_if) {
+            if (optimize() >= 2 && op.opname() == u_if) {
                 int jump = op.farthest_jump ();
                 bool only_nops = true;
                 for (int i = opnum+1;  i < jump && only_nops;  ++i)
@@ -2357,7 +2609,7 @@ RuntimeOptimizer::optimize_instance ()
             // N.B. This is a regular "if", not an "else if", because we
             // definitely want to catch any 'assign' statements that
             // were put in by the constant folding routines above.
-            if (m_shadingsys.optimize() >= 2 && op.opname() == u_assign/* &&
+            if (optimize() >= 2 && op.opname() == u_assign/* &&
                                                                                    inst()->argsymbol(op.firstarg()+1)->is_constant()*/) {
                 Symbol *R (inst()->argsymbol(op.firstarg()+0));
                 Symbol *A (inst()->argsymbol(op.firstarg()+1));
@@ -2381,7 +2633,10 @@ RuntimeOptimizer::optimize_instance ()
                 // NOW do assignment constant folding, only after we
                 // have performed all the other transformations that may
                 // turn this op into an assignment.
-                changed += constfold_assign (*this, opnum);
+                {
+                    PassTimer t (*this, "constant folding");
+                    changed += t.count (constfold_assign (*this, opnum));
+                }
 
                 if (A->is_constant() &&
                         equivalent(R->typespec(), A->typespec())) {
@@ -2404,13 +2659,20 @@ RuntimeOptimizer::optimize_instance ()
                     ++changed;
                     continue;
                 }
-                if (R_local_or_tmp && ! R->everread()) {
-                    // This local is written but NEVER READ.  nop it.
+                if ((R_local_or_tmp || unneeded_output (*R)) &&
+                        ! R->everread()) {
+                    // This local (or output nobody wants) is written
+                    // but NEVER READ.  nop it.
                     turn_into_nop (op);
                     ++changed;
                     continue;
                 }
-                if (outparam_assign_elision (opnum, op)) {
+                bool elided;
+                {
+                    PassTimer t (*this, "outparam_assign_elision");
+                    elided = t.count (outparam_assign_elision (opnum, op));
+                }
+                if (elided) {
                     ++changed;
                     continue;
                 }
@@ -2418,20 +2680,31 @@ RuntimeOptimizer::optimize_instance ()
                     // Just an assignment to itself -- turn into NOP!
                     turn_into_nop (op);
                     ++changed;
-                } else if (R_local_or_tmp && R->lastread() < opnum) {
+                } else if ((R_local_or_tmp || unneeded_output (*R)) &&
+                           R->lastread() < opnum) {
                     // Don't bother assigning if we never read it again
                     turn_into_nop (op);
                     ++changed;
                 }
             }
 
-            if (m_shadingsys.optimize() >= 2)
-                changed += useless_op_elision (op);
+            if (optimize() >= 2) {
+                PassTimer t (*this, "useless_op_elision");
+                changed += t.count (useless_op_elision (op));
+            }
 
             // Peephole optimization involving pair of instructions
-            if (m_shadingsys.optimize() >= 2)
-                changed += peephole2 (opnum);
+            if (optimize() >= 2) {
+                PassTimer t (*this, "peephole2");
+                changed += t.count (peephole2 (opnum));
+            }
+
+        }
 
+        // Reuse the results of identical pure ops within each block
+        if (optimize() >= 2) {
+            PassTimer t (*this, "common subexpressions");
+            changed += t.count (eliminate_common_subexpressions ());
         }
 
         totalchanged += changed;
@@ -2488,8 +2761,8 @@ RuntimeOptimizer::optimize_instance ()
     // Clear init ops of params that aren't used.
     // FIXME -- is this ineffective?  Should it be never READ?
     FOREACH_PARAM (Symbol &s, inst()) {
-        if (s.symtype() == SymTypeParam && ! s.everused() &&
-                s.initbegin() < s.initend()) {
+        if ((s.symtype() == SymTypeParam || unneeded_output (s)) &&
+                ! s.everused() && s.initbegin() < s.initend()) {
             for (int i = s.initbegin();  i < s.initend();  ++i)
                 turn_into_nop (inst()->ops()[i]);
             s.set_initrange (0, 0);
@@ -2499,6 +2772,14 @@ RuntimeOptimizer::optimize_instance ()
     // Now that we've optimized this layer, walk through the ops and
     // note which messages may have been sent, so subsequent layers will
     // know.
+    note_messages_sent ();
+}
+
+
+
+void
+RuntimeOptimizer::note_messages_sent ()
+{
     for (int opnum = 0;  opnum < (int)inst()->ops().size();  ++opnum) {
         Opcode &op (inst()->ops()[opnum]);
         if (op.opname() == u_setmessage) {
@@ -2513,6 +2794,89 @@ RuntimeOptimizer::optimize_instance ()
 
 
 
+bool
+RuntimeOptimizer::reuse_specialization (const std::string &key)
+{
+    SpecializedInstanceRef spec = m_shadingsys.find_specialized_instance (key);
+    if (! spec)
+        return false;
+
+    ShaderInstance &in (*inst());
+    off_t opmem = vectorbytes (in.m_instops);
+    off_t argmem = vectorbytes (in.m_instargs);
+    off_t symmem = vectorbytes (in.m_instsymbols);
+    off_t connectionmem = vectorbytes (in.m_connections);
+    in.m_instops = spec->ops;
+    in.m_instargs = spec->args;
+    in.m_instsymbols = spec->symbols;
+    in.m_iparams = spec->iparams;
+    in.m_fparams = spec->fparams;
+    in.m_sparams = spec->sparams;
+    in.bind_instance_values ();
+    ConnectionVec connections;
+    BOOST_FOREACH (int c, spec->connections)
+        connections.push_back (in.m_connections[c]);
+    in.m_connections.swap (connections);
+    in.m_maincodebegin = spec->maincodebegin;
+    in.m_maincodeend = spec->maincodeend;
+    in.outgoing_connections (spec->outgoing_connections);
+    opmem = vectorbytes (in.m_instops) - opmem;
+    argmem = vectorbytes (in.m_instargs) - argmem;
+    symmem = vectorbytes (in.m_instsymbols) - symmem;
+    connectionmem = vectorbytes (in.m_connections) - connectionmem;
+    off_t totalmem = opmem + argmem + symmem + connectionmem;
+
+    // Later passes may add constants to this layer, too; keep their
+    // names distinct from the ones it already has.
+    m_next_newconst = std::max (m_next_newconst, spec->next_newconst);
+    note_messages_sent ();
+
+    spin_lock lock (m_shadingsys.m_stat_mutex);
+    m_shadingsys.m_stat_mem_inst_ops += opmem;
+    m_shadingsys.m_stat_mem_inst_args += argmem;
+    m_shadingsys.m_stat_mem_inst_syms += symmem;
+    m_shadingsys.m_stat_mem_inst_connections += connectionmem;
+    m_shadingsys.m_stat_mem_inst += totalmem;
+    m_shadingsys.m_stat_memory += totalmem;
+    return true;
+}
+
+
+
+void
+RuntimeOptimizer::remember_specialization (const std::string &key,
+                                           const ConnectionVec &connections)
+{
+    const ShaderInstance &in (*inst());
+    SpecializedInstanceRef spec (new SpecializedInstance);
+    spec->ops = in.m_instops;
+    spec->args = in.m_instargs;
+    spec->symbols = in.m_instsymbols;
+    spec->iparams = in.m_iparams;
+    spec->fparams = in.m_fparams;
+    spec->sparams = in.m_sparams;
+    // optimize_instance only ever erases connections, so the survivors
+    // are, in order, a subset of what we started with.
+    for (size_t c = 0, s = 0;  c < connections.size() &&
+                               s < in.m_connections.size();  ++c) {
+        const Connection &a (connections[c]), &b (in.m_connections[s]);
+        if (a.srclayer == b.srclayer && a.src.param == b.src.param &&
+                a.dst.param == b.dst.param &&
+                a.dst.arrayindex == b.dst.arrayindex &&
+                a.dst.channel == b.dst.channel) {
+            spec->connections.push_back ((int)c);
+            ++s;
+        }
+    }
+    spec->maincodebegin = in.m_maincodebegin;
+    spec->maincodeend = in.m_maincodeend;
+    spec->outgoing_connections = in.outgoing_connections ();
+    spec->next_newconst = m_next_newconst;
+    m_shadingsys.register_specialized_instance (key, spec);
+}
+
+
+
 void
 RuntimeOptimizer::track_variable_lifetimes (const SymbolPtrVec &allsymptrs)
 {
@@ -2664,6 +3028,11 @@ RuntimeOptimizer::track_variable_dependencies ()
     // connection.
     int snum = 0;
     BOOST_FOREACH (Symbol &s, inst()->symbols()) {
+        // In a group variant without derivatives, nothing gets them.
+        if (! m_group.derivs()) {
+            s.has_derivs (false);
+            continue;
+        }
         // Globals that get written should always provide derivs.
         // Exclude N, since its derivs are unreliable anyway, so no point
         // making it cause the whole disp shader to need derivs.
@@ -2678,7 +3047,7 @@ RuntimeOptimizer::track_variable_dependencies ()
     // Mark all symbols needing derivatives as such
     BOOST_FOREACH (int d, symdeps[DerivSym]) {
         Symbol *s = inst()->symbol(d);
-        if (! s->typespec().is_closure() && 
+        if (! s->typespec().is_closure() && m_group.derivs() &&
                 s->typespec().elementtype().is_floatbased())
             s->has_derivs (true);
     }
@@ -2756,11 +3125,11 @@ coalescable (const Symbol &s)
 /// Coalesce temporaries.  During code generation, we make a new
 /// temporary EVERY time we need one.  Now we examine them all and merge
 /// ones of identical type and non-overlapping lifetimes.
-void
+int
 RuntimeOptimizer::coalesce_temporaries ()
 {
     // We keep looping until we can't coalesce any more.
-    int ncoalesced = 1;
+    int ncoalesced = 1, total = 0;
     while (ncoalesced) {
         ncoalesced = 0;   // assume we're done, unless we coalesce something
 
@@ -2805,6 +3174,7 @@ RuntimeOptimizer::coalesce_temporaries ()
             }
         }
         // std::cerr << "Coalesced " << ncoalesced << "\n";
+        total += ncoalesced;
     }
 
     // Since we may have aliased temps, now we need to make sure all
@@ -2814,6 +3184,7 @@ RuntimeOptimizer::coalesce_temporaries ()
         s = s->dealias ();
         arg = s - inst()->symbol(0);
     }
+    return total;
 }
 
 
@@ -2828,8 +3199,10 @@ RuntimeOptimizer::post_optimize_instance ()
 
     add_useparam (allsymptrs);
 
-    if (m_shadingsys.optimize() >= 1)
-        coalesce_temporaries ();
+    if (optimize() >= 1) {
+        PassTimer t (*this, "coalesce_temporaries");
+        t.count (coalesce_temporaries ());
+    }
 }
 
 
@@ -2994,6 +3367,135 @@ RuntimeOptimizer::collapse_ops ()
 
 
 
+void
+RuntimeOptimizer::discard_instance_code ()
+{
+    // Clear the syms and ops, we'll never use this layer
+    SymbolVec nosyms;
+    std::swap (inst()->symbols(), nosyms);
+    OpcodeVec noops;
+    std::swap (inst()->ops(), noops);
+    {
+        // adjust memory stats
+        // Remember that they're already swapped
+        off_t symmem = vectorbytes(nosyms);
+        off_t opmem = vectorbytes(noops);
+        ShadingSystemImpl &ss (shadingsys());
+        spin_lock lock (ss.m_stat_mutex);
+        ss.m_stat_mem_inst_syms -= symmem;
+        ss.m_stat_mem_inst_ops -= opmem;
+        ss.m_stat_mem_inst -= (symmem+opmem);
+        ss.m_stat_memory -= (symmem+opmem);
+    }
+}
+
+
+
+void
+RuntimeOptimizer::llvm_compile_group ()
+{
+    Timer timer;
+    // Check out our own LLVM context/module/engine, so that we can JIT
+    // at the same time as other threads are JITing other groups.
+    m_llvm_state = m_shadingsys.acquire_llvm_state ();
+    double acquire_time = timer();
+    double setup_lock_time = 0;
+    bool setup = m_shadingsys.SetupLLVM (*m_llvm_state, setup_lock_time);
+    m_stat_opt_locking_time += acquire_time + setup_lock_time;
+    if (! setup) {
+        // Leave the group without code; the error has already been
+        // reported.
+        m_shadingsys.release_llvm_state (m_llvm_state);
+        m_llvm_state = NULL;
+        m_stat_total_llvm_time = timer();
+        return;
+    }
+    m_stat_llvm_setup_time = timer() - acquire_time - setup_lock_time;
+    build_llvm_group ();
+
+    // The builder and pass managers refer to the context, so be done
+    // with them before another thread can get its hands on it.
+    delete m_builder;  m_builder = NULL;
+    delete m_llvm_passes;  m_llvm_passes = NULL;
+    for (size_t i = 0;  i < m_llvm_timed_passes.size();  ++i)
+        delete m_llvm_timed_passes[i].second;
+    m_llvm_timed_passes.clear ();
+    delete m_llvm_func_passes;  m_llvm_func_passes = NULL;
+    delete m_llvm_func_passes_optimized;  m_llvm_func_passes_optimized = NULL;
+    m_shadingsys.release_llvm_state (m_llvm_state);
+    m_llvm_state = NULL;
+
+    m_stat_total_llvm_time = timer();
+}
+
+
+
+void
+RuntimeOptimizer::finish_layer (int layer, size_t &nsyms, size_t &nops)
+{
+    set_inst (layer);
+    nsyms = nops = 0;
+    if (inst()->unused()) {
+        discard_instance_code ();
+        return;
+    }
+
+    post_optimize_instance ();
+    if (optimize() >= 1) {
+        // collapse_syms also renumbers the source params of later
+        // layers' connections from this layer, but only this layer
+        // touches those, and only the later layers' own dest params.
+        {
+            PassTimer t (*this, "collapse_syms");
+            int before = (int) inst()->symbols().size();
+            collapse_syms ();
+            t.count (before - (int) inst()->symbols().size());
+        }
+        {
+            PassTimer t (*this, "collapse_ops");
+            int before = (int) inst()->ops().size();
+            collapse_ops ();
+            t.count (before - (int) inst()->ops().size());
+        }
+        if (m_shadingsys.debug()) {
+            track_variable_lifetimes ();
+            std::cout << "After optimizing layer " << layer << " " 
+                      << inst()->layername() << " (" << inst()->id()
+                      << "): \n" << inst()->print() 
+                      << "\n--------------------------------\n\n";
+        }
+    }
+    nsyms = inst()->symbols().size();
+    nops = inst()->ops().size();
+}
+
+
+
+namespace {
+
+/// Body of the threads that finish the layers of a group: keep taking
+/// the next unclaimed layer until there are none left.  The results
+/// are the same as finishing them in order, since layers don't depend
+/// on each other at this point.
+void
+finish_layers (ShadingSystemImpl *shadingsys, ShaderGroup *group,
+               atomic_int *nextlayer, std::vector<size_t> *nsyms,
+               std::vector<size_t> *nops)
+{
+    RuntimeOptimizer rop (*shadingsys, *group);
+    for (;;) {
+        int layer = (*nextlayer)++;
+        if (layer >= group->nlayers())
+            break;
+        rop.finish_layer (layer, (*nsyms)[layer], (*nops)[layer]);
+    }
+    shadingsys->merge_pass_stats (rop.pass_stats());
+}
+
+};  // anon namespace
+
+
+
 void
 RuntimeOptimizer::optimize_group ()
 {
@@ -3010,12 +3512,34 @@ RuntimeOptimizer::optimize_group ()
     if (m_shadingsys.m_closure_registry.empty())
         m_shadingsys.register_builtin_closures();
 
+    // The JIT cache key also serves to fingerprint the group, so that
+    // identical groups can share their optimized instances and code.
+    if (m_shadingsys.dedup_groups() || m_shadingsys.cachedir().size())
+        m_jitcache_key = jitcache_key ();
+    // (Groups with interactive params are never shared, since
+    // ReParameter changes the values in one group's own instances.)
+    if (m_shadingsys.dedup_groups() && ! m_group.interactive() &&
+          m_shadingsys.adopt_equivalent_group (m_jitcache_key, m_group))
+        return;
+
+    // If there's a JIT cache, we may have compiled this exact group
+    // before (probably in an earlier run), and can skip all the work.
+    if (m_shadingsys.cachedir().size()) {
+        m_llvm_relocatable = true;
+        if (jitcache_load ()) {
+            m_group.tier (1);
+            m_group.jitcache_key (m_jitcache_key);
+            m_shadingsys.register_equivalent_group (m_jitcache_key, m_group);
+            return;
+        }
+    }
+
     // Optimize each layer, from first to last
     size_t old_nsyms = 0, old_nops = 0;
     for (int layer = 0;  layer < nlayers;  ++layer) {
         set_inst (layer);
         m_inst->copy_code_from_master ();
-        if (m_shadingsys.debug() && m_shadingsys.optimize() >= 1 && layer==0) {
+        if (m_shadingsys.debug() && optimize() >= 1 && layer==0) {
             std::cout << "Before optimizing layer " << layer << " " 
                       << inst()->layername() 
                       << ", I get:\n" << inst()->print()
@@ -3024,7 +3548,21 @@ RuntimeOptimizer::optimize_group ()
 
         old_nsyms += inst()->symbols().size();
         old_nops += inst()->ops().size();
+
+        // The same master with the same parameters and surroundings
+        // may well have been specialized already, in another group.
+        std::string key;
+        if (m_shadingsys.memoize_instances()) {
+            key = specialization_key ();
+            if (reuse_specialization (key))
+                continue;
+        }
+        ConnectionVec connections;
+        if (key.size())
+            connections = inst()->connections ();
         optimize_instance ();
+        if (key.size())
+            remember_specialization (key, connections);
     }
 
     // Optimize each layer again, from last to first (because some
@@ -3055,66 +3593,46 @@ RuntimeOptimizer::optimize_group ()
         }
     }
 
-    // Post-opt cleanup: add useparam, coalesce temporaries, etc.
-    for (int layer = 0;  layer < nlayers;  ++layer) {
-        set_inst (layer);
-        if (! inst()->unused())
-            post_optimize_instance ();
+    // Post-opt cleanup (add useparam, coalesce temporaries, etc.) and
+    // removal of nop instructions and unused symbols.  The passes above
+    // each need results from neighboring layers, but these don't, so
+    // with big groups we split the layers among threads.  It isn't worth
+    // handing out fewer than a few layers per thread.  (Debug output
+    // is printed per layer, so it stays serial to keep it in order.)
+    const int min_layers_per_thread = 4;
+    std::vector<size_t> layer_nsyms (nlayers), layer_nops (nlayers);
+    int nthreads = std::min (m_shadingsys.optimize_threads(),
+                             nlayers / min_layers_per_thread);
+    if (nthreads > 1 && ! m_shadingsys.debug()) {
+        atomic_int nextlayer;
+        nextlayer = 0;
+        m_shadingsys.run_with_helpers (boost::bind (&finish_layers,
+                                                    &m_shadingsys, &m_group,
+                                                    &nextlayer, &layer_nsyms,
+                                                    &layer_nops),
+                                       nthreads - 1);
+    } else {
+        for (int layer = 0;  layer < nlayers;  ++layer)
+            finish_layer (layer, layer_nsyms[layer], layer_nops[layer]);
     }
-
-    // Get rid of nop instructions and unused symbols.
     size_t new_nsyms = 0, new_nops = 0;
     for (int layer = 0;  layer < nlayers;  ++layer) {
-        set_inst (layer);
-        if (inst()->unused()) {
-            // Clear the syms and ops, we'll never use this layer
-            SymbolVec nosyms;
-            std::swap (inst()->symbols(), nosyms);
-            OpcodeVec noops;
-            std::swap (inst()->ops(), noops);
-            {
-                // adjust memory stats
-                // Remember that they're already swapped
-                off_t symmem = vectorbytes(nosyms);
-                off_t opmem = vectorbytes(noops);
-                ShadingSystemImpl &ss (shadingsys());
-                spin_lock lock (ss.m_stat_mutex);
-                ss.m_stat_mem_inst_syms -= symmem;
-                ss.m_stat_mem_inst_ops -= opmem;
-                ss.m_stat_mem_inst -= (symmem+opmem);
-                ss.m_stat_memory -= (symmem+opmem);
-            }
-            continue;
-        }
-        if (m_shadingsys.optimize() >= 1) {
-            collapse_syms ();
-            collapse_ops ();
-            if (m_shadingsys.debug()) {
-                track_variable_lifetimes ();
-                std::cout << "After optimizing layer " << layer << " " 
-                          << inst()->layername() << " (" << inst()->id()
-                          << "): \n" << inst()->print() 
-                          << "\n--------------------------------\n\n";
-            }
-        }
-        new_nsyms += inst()->symbols().size();
-        new_nops += inst()->ops().size();
+        new_nsyms += layer_nsyms[layer];
+        new_nops += layer_nops[layer];
     }
+    m_stat_preopt_syms = old_nsyms;
+    m_stat_postopt_syms = new_nsyms;
+    m_stat_preopt_ops = old_nops;
+    m_stat_postopt_ops = new_nops;
 
     m_stat_specialization_time = rop_timer();
 
-    Timer timer;
-    // Let's punt on multithreading LLVM for the time being,
-    // just make a big lock.
-    static mutex llvm_mutex;
-    lock_guard llvm_lock (llvm_mutex);
-    m_stat_opt_locking_time = timer();
-
-    m_shadingsys.SetupLLVM ();
-    m_stat_llvm_setup_time = timer() - m_stat_opt_locking_time;
-    build_llvm_group ();
-
-    m_stat_total_llvm_time = timer();
+    // First-tier groups get only the quick LLVM passes, too; they're
+    // replaced with fully optimized copies if they get hot.
+    m_llvm_quick = (m_group.tier() == 0);
+    m_group.jitcache_key (m_jitcache_key);
+    llvm_compile_group ();
+    m_shadingsys.register_equivalent_group (m_jitcache_key, m_group);
 
 
     m_shadingsys.info ("Optimized shader group: New syms %llu/%llu (%5.1f%%), ops %llu/%llu (%5.1f%%)",
@@ -3132,6 +3650,45 @@ RuntimeOptimizer::optimize_group ()
 
 
 
+void
+ShadingSystemImpl::fold_constant_userdata (ShadingAttribState &attribstate,
+                                           ShaderGroup &group)
+{
+    {
+        // Each group we specialize is one more to compile, and won't
+        // be shared with the groups of objects with other userdata.
+        // Take our place under the limit now, so that groups optimized
+        // at the same time can't all slip in; give it back if it turns
+        // out there was nothing to fold.
+        spin_lock lock (m_stat_mutex);
+        if (m_max_userdata_groups > 0 &&
+              m_stat_userdata_groups >= m_max_userdata_groups)
+            return;
+        ++m_stat_userdata_groups;
+    }
+    const ParamValueList &userdata (attribstate.constant_userdata ());
+    int nfolded = 0;
+    for (int layer = 0;  layer < group.nlayers();  ++layer) {
+        BOOST_FOREACH (const ParamValue &p, userdata) {
+            if (! group[layer]->can_fold_userdata (p))
+                continue;
+            // Another attribute state (perhaps with other userdata) may
+            // share the instance; change only our own copy.
+            if (! group.m_layers[layer].unique())
+                group.m_layers[layer].reset (new ShaderInstance (*group[layer]));
+            if (group[layer]->fold_userdata (p))
+                ++nfolded;
+        }
+    }
+    spin_lock lock (m_stat_mutex);
+    if (nfolded)
+        m_stat_userdata_params += nfolded;
+    else
+        --m_stat_userdata_groups;
+}
+
+
+
 void
 ShadingSystemImpl::optimize_group (ShadingAttribState &attribstate, 
                                    ShaderGroup &group)
@@ -3147,6 +3704,27 @@ ShadingSystemImpl::optimize_group (ShadingAttribState &attribstate,
     }
     double locking_time = timer();
 
+    // Variants are made from the (already folded) unoptimized copies
+    if (attribstate.constant_userdata().size() &&
+          group.raytype() < 0 && group.derivs())
+        fold_constant_userdata (attribstate, group);
+
+    // With tiered compilation, start with code that's quick to build:
+    // no constant folding, and just the quick LLVM passes.
+    group.tier (m_tier_threshold > 0 ? 0 : 1);
+
+    // Keep unoptimized copies of the instances, from which we can make
+    // variants of the group specialized for particular raytypes or
+    // without derivatives, or the fully optimized group that replaces
+    // a first-tier group once it gets hot.
+    if (((m_raytype_variants > 0 || m_noderivs_variants) &&
+           group.raytype() < 0 && group.derivs()) || group.tier() == 0) {
+        group.m_pristine_layers.clear ();
+        for (int layer = 0;  layer < group.nlayers();  ++layer)
+            group.m_pristine_layers.push_back (
+                ShaderInstanceRef (new ShaderInstance (*group[layer])));
+    }
+
     RuntimeOptimizer rop (*this, group);
     rop.optimize_group ();
 
@@ -3161,6 +3739,506 @@ ShadingSystemImpl::optimize_group (ShadingAttribState &attribstate,
     m_stat_llvm_irgen_time += rop.m_stat_llvm_irgen_time;
     m_stat_llvm_opt_time += rop.m_stat_llvm_opt_time;
     m_stat_llvm_jit_time += rop.m_stat_llvm_jit_time;
+    m_stat_cse_ops += rop.m_stat_cse_ops;
+    m_stat_preopt_syms += rop.m_stat_preopt_syms;
+    m_stat_postopt_syms += rop.m_stat_postopt_syms;
+    m_stat_preopt_ops += rop.m_stat_preopt_ops;
+    m_stat_postopt_ops += rop.m_stat_postopt_ops;
+    BOOST_FOREACH (const PassStats &p, rop.pass_stats())
+        add_pass_stats (m_stat_passes, p.name, p.time, p.changes, p.runs);
+    if (rop.m_stat_groupdata_size) {
+        ++m_stat_groupdata_groups;
+        m_stat_groupdata_size += rop.m_stat_groupdata_size;
+        m_stat_groupdata_hot_size += rop.m_stat_groupdata_hot_size;
+        m_stat_groupdata_layers += rop.m_stat_groupdata_layers;
+        m_stat_groupdata_max = std::max (m_stat_groupdata_max,
+                                         (long long)rop.m_stat_groupdata_size);
+    }
+}
+
+
+
+bool
+ShadingSystemImpl::adopt_equivalent_group (const std::string &fingerprint,
+                                           ShaderGroup &group)
+{
+    std::vector<ShaderInstanceRef> layers;
+    SharedGroupCodeRef code;
+    EquivalentGroup eq;
+    {
+        lock_guard lock (m_equivalent_groups_mutex);
+        EquivalentGroupMap::iterator found = m_equivalent_groups.find (fingerprint);
+        if (found != m_equivalent_groups.end()) {
+            BOOST_FOREACH (std::tr1::weak_ptr<ShaderInstance> &w,
+                           found->second.layers) {
+                ShaderInstanceRef inst = w.lock ();
+                if (! inst)
+                    break;   // The group we'd share has since been freed
+                layers.push_back (inst);
+            }
+            // The code may be gone even if the instances aren't
+            code = found->second.code.lock ();
+            if (layers.size() != found->second.layers.size() || ! code) {
+                m_equivalent_groups.erase (found);
+                layers.clear ();
+            } else if (code->tier < group.tier()) {
+                // Just first-tier code so far, and we want better
+                layers.clear ();
+            } else {
+                eq = found->second;
+            }
+        }
+    }
+    if (layers.empty()) {
+        spin_lock stat_lock (m_stat_mutex);
+        ++m_stat_dedup_misses;
+        return false;
+    }
+
+    // Swap in the optimized instances; our own unoptimized ones are
+    // freed when layers goes out of scope.  The code may be fully
+    // optimized even if first-tier code would have done.
+    group.m_layers.swap (layers);
+    group.llvm_groupdata_size (eq.groupdata_size);
+    group.does_nothing (eq.does_nothing);
+    group.inits_groupdata (eq.inits_groupdata);
+    group.jitcache_key (fingerprint);
+    group.m_shared_code = code;
+    group.tier (code->tier);
+    group.add_llvm_jit_memory (code->jitmem);
+    group.llvm_compiled_version (code->func);
+
+    spin_lock stat_lock (m_stat_mutex);
+    ++m_stat_dedup_hits;
+    m_stat_dedup_mem_saved += eq.mem;
+    return true;
+}
+
+
+
+void
+ShadingSystemImpl::register_equivalent_group (const std::string &fingerprint,
+                                              ShaderGroup &group)
+{
+    if (! m_dedup_groups || fingerprint.empty() || ! group.llvm_jit_memory() ||
+          group.interactive())
+        return;
+    EquivalentGroup eq;
+    eq.mem = 0;
+    for (int layer = 0;  layer < group.nlayers();  ++layer) {
+        const ShaderInstance *inst = group[layer];
+        eq.layers.push_back (group.m_layers[layer]);
+        eq.mem += vectorbytes (inst->ops()) + vectorbytes (inst->args()) +
+                  vectorbytes (inst->symbols()) + sizeof(ShaderInstance);
+    }
+    SharedGroupCodeRef code (new SharedGroupCode);
+    code->func = group.llvm_compiled_version ();
+    code->jitmem = group.llvm_jit_memory ();
+    code->tier = group.tier ();
+    group.m_shared_code = code;
+    eq.code = code;
+    eq.groupdata_size = group.llvm_groupdata_size ();
+    eq.does_nothing = group.does_nothing ();
+    eq.inits_groupdata = group.inits_groupdata ();
+    lock_guard lock (m_equivalent_groups_mutex);
+    // Don't let first-tier code displace a fully optimized group that's
+    // still around.
+    EquivalentGroupMap::iterator found = m_equivalent_groups.find (fingerprint);
+    if (found != m_equivalent_groups.end()) {
+        SharedGroupCodeRef old = found->second.code.lock ();
+        if (old && old->tier > code->tier)
+            return;
+    }
+    m_equivalent_groups[fingerprint] = eq;
+}
+
+
+
+void
+ShadingSystemImpl::merge_pass_stats (const PassStatsVec &stats)
+{
+    if (stats.empty())
+        return;
+    spin_lock lock (m_stat_mutex);
+    BOOST_FOREACH (const PassStats &p, stats)
+        add_pass_stats (m_stat_passes, p.name, p.time, p.changes, p.runs);
+}
+
+
+
+SpecializedInstanceRef
+ShadingSystemImpl::find_specialized_instance (const std::string &key)
+{
+    SpecializedInstanceRef spec;
+    {
+        lock_guard lock (m_specialized_instances_mutex);
+        SpecializedInstanceMap::const_iterator found =
+            m_specialized_instances.find (key);
+        if (found != m_specialized_instances.end())
+            spec = found->second;
+    }
+    spin_lock stat_lock (m_stat_mutex);
+    if (spec)
+        ++m_stat_instance_memo_hits;
+    else
+        ++m_stat_instance_memo_misses;
+    return spec;
+}
+
+
+
+void
+ShadingSystemImpl::register_specialized_instance (const std::string &key,
+                                                  SpecializedInstanceRef spec)
+{
+    off_t mem = vectorbytes (spec->ops) + vectorbytes (spec->args) +
+                vectorbytes (spec->symbols) + vectorbytes (spec->iparams) +
+                vectorbytes (spec->fparams) + vectorbytes (spec->sparams) +
+                vectorbytes (spec->connections) + sizeof(SpecializedInstance);
+    {
+        lock_guard lock (m_specialized_instances_mutex);
+        // Two threads may have specialized the same layer at once;
+        // either result will do.
+        if (! m_specialized_instances.insert (std::make_pair (key, spec)).second)
+            return;
+    }
+    spin_lock stat_lock (m_stat_mutex);
+    m_specialized_instances_mem += mem;
+    m_stat_memory += mem;
+}
+
+
+
+ShaderGroup *
+ShadingSystemImpl::group_variant (ShadingAttribState &attribstate,
+                                  ShaderGroup &group, int raytype, bool derivs)
+{
+    if (! m_raytype_variants)
+        raytype = -1;
+    if (! m_noderivs_variants)
+        derivs = true;
+    if ((raytype < 0 && derivs) || group.m_pristine_layers.empty())
+        return &group;
+    ShaderGroup *variant = NULL;
+    bool created = false;
+    {
+        spin_lock lock (group.m_variants_mutex);
+        BOOST_FOREACH (shared_ptr<ShaderGroup> &v, group.m_variants) {
+            if (v->raytype() == raytype && v->derivs() == derivs) {
+                variant = v.get();
+                break;
+            }
+        }
+        if (! variant) {
+            // Beyond the limit, just run the unspecialized code
+            int maxvariants = (m_raytype_variants + 1) *
+                              (m_noderivs_variants ? 2 : 1) - 1;
+            if ((int)group.m_variants.size() >= maxvariants)
+                return &group;
+            shared_ptr<ShaderGroup> v (new ShaderGroup);
+            v->m_raytype = raytype;
+            v->m_derivs = derivs;
+            BOOST_FOREACH (ShaderInstanceRef &inst, group.m_pristine_layers)
+                v->append (ShaderInstanceRef (new ShaderInstance (*inst)));
+            group.m_variants.push_back (v);
+            variant = v.get();
+            created = true;
+        }
+    }
+    if (created) {
+        spin_lock stat_lock (m_stat_mutex);
+        ++m_stat_group_variants;
+    }
+
+    if (! variant->optimized()) {
+        if (m_async_compile) {
+            // Use the unspecialized code until the variant is ready
+            optimize_group_async (attribstate, *variant);
+            if (! variant->optimized())
+                return &group;
+        } else {
+            optimize_group (attribstate, *variant);
+        }
+    }
+    return variant;
+}
+
+
+
+void
+ShadingSystemImpl::optimize_group_async (ShadingAttribState &attribstate,
+                                         ShaderGroup &group)
+{
+    if (! group.optimized())
+        queue_compile (&attribstate, group);
+}
+
+
+
+void
+ShadingSystemImpl::queue_compile (ShadingAttribState *attribstate,
+                                  ShaderGroup &group)
+{
+    boost::unique_lock<boost::mutex> lock (m_compile_mutex);
+    if (group.m_compile_queued || m_compile_shutdown)
+        return;
+    if (attribstate ? group.optimized()
+                    : (group.tier() > 0 || group.tiered_up()))
+        return;   // finished while we waited for the lock
+    CompileRequest req;
+    req.attribstate = attribstate;
+    req.group = &group;
+    group.m_compile_queued = true;
+    group.m_compile_owner = this;
+    m_compile_queue.push_back (req);
+    ++m_compile_pending;
+    // Start another compile thread if we're allowed more and there's
+    // more work queued than the existing threads can start on.
+    if (m_ncompile_threads < m_async_compile &&
+            m_compile_pending > m_ncompile_threads) {
+        m_compile_threads.create_thread (
+            boost::bind (&ShadingSystemImpl::compile_thread_main, this));
+        ++m_ncompile_threads;
+    }
+    m_compile_cond.notify_one ();
+}
+
+
+
+void
+ShadingSystemImpl::request_recompile (ShaderGroup &group)
+{
+    if (m_async_compile)
+        queue_compile (NULL, group);
+    else
+        recompile_group (group);
+}
+
+
+
+void
+ShadingSystemImpl::recompile_group (ShaderGroup &group, bool wait)
+{
+    // Unless told to wait, don't queue up behind another thread that's
+    // already recompiling the group; keep running the first-tier code
+    // until it's done.
+    boost::unique_lock<mutex> lock (group.m_mutex, boost::defer_lock);
+    if (wait)
+        lock.lock ();
+    else if (! lock.try_lock ())
+        return;
+    if (group.tier() > 0 || group.m_tier_up ||
+          group.m_pristine_layers.empty())
+        return;   // somebody beat us to it, or there's nothing to do
+
+    // The first-tier code wasn't specialized much, so rather than just
+    // generating it again, fully optimize a fresh copy of the unoptimized
+    // instances.  Other threads may be running the first-tier code, which
+    // uses the group's own instances and group data layout, so the copy
+    // is a separate group that runs in its place (like a variant) once
+    // it's ready.
+    Timer timer;
+    shared_ptr<ShaderGroup> hot (new ShaderGroup);
+    hot->m_raytype = group.m_raytype;
+    hot->m_derivs = group.m_derivs;
+    hot->m_renderer_outputs = group.m_renderer_outputs;
+    BOOST_FOREACH (ShaderInstanceRef &inst, group.m_pristine_layers)
+        hot->append (ShaderInstanceRef (new ShaderInstance (*inst)));
+    {
+        // So that ReParameter reaches it from here on
+        spin_lock vlock (group.m_variants_mutex);
+        group.m_tier_up = hot;
+    }
+    RuntimeOptimizer rop (*this, *hot);
+    rop.optimize_group ();
+    hot->m_optimized = true;
+    if (hot->llvm_compiled_version())
+        group.m_tier_up_ptr = hot.get();
+    else
+        group.tier (1);   // keep the code we have; don't try again
+
+    merge_pass_stats (rop.pass_stats());
+    spin_lock stat_lock (m_stat_mutex);
+    ++m_stat_tier_recompiles;
+    m_stat_tier_recompile_time += timer();
+    m_stat_opt_locking_time += rop.m_stat_opt_locking_time;
+    m_stat_specialization_time += rop.m_stat_specialization_time;
+    m_stat_total_llvm_time += rop.m_stat_total_llvm_time;
+    m_stat_llvm_setup_time += rop.m_stat_llvm_setup_time;
+    m_stat_llvm_irgen_time += rop.m_stat_llvm_irgen_time;
+    m_stat_llvm_opt_time += rop.m_stat_llvm_opt_time;
+    m_stat_llvm_jit_time += rop.m_stat_llvm_jit_time;
+    m_stat_cse_ops += rop.m_stat_cse_ops;
+    m_stat_preopt_syms += rop.m_stat_preopt_syms;
+    m_stat_postopt_syms += rop.m_stat_postopt_syms;
+    m_stat_preopt_ops += rop.m_stat_preopt_ops;
+    m_stat_postopt_ops += rop.m_stat_postopt_ops;
+}
+
+
+
+void
+ShadingSystemImpl::wait_for_compiles ()
+{
+    boost::unique_lock<boost::mutex> lock (m_compile_mutex);
+    while (m_compile_pending)
+        m_compile_done_cond.wait (lock);
+}
+
+
+
+void
+ShadingSystemImpl::cancel_compile (ShaderGroup &group)
+{
+    boost::unique_lock<boost::mutex> lock (m_compile_mutex);
+    for (std::deque<CompileRequest>::iterator r = m_compile_queue.begin();
+         r != m_compile_queue.end();  ) {
+        if (r->group == &group) {
+            r = m_compile_queue.erase (r);
+            --m_compile_pending;
+        } else {
+            ++r;
+        }
+    }
+    group.m_compile_queued = false;
+    while (group.m_compile_running)
+        m_compile_done_cond.wait (lock);
+    group.m_compile_owner = NULL;
+    // wait_for_compiles may be waiting on what we just dropped
+    m_compile_done_cond.notify_all ();
+}
+
+
+
+void
+ShadingSystemImpl::compile_thread_main ()
+{
+    for (;;) {
+        CompileRequest req;
+        {
+            boost::unique_lock<boost::mutex> lock (m_compile_mutex);
+            while (m_compile_queue.empty() && ! m_compile_shutdown)
+                m_compile_cond.wait (lock);
+            if (m_compile_shutdown)
+                return;
+            req = m_compile_queue.front ();
+            m_compile_queue.pop_front ();
+            // Until we're done, cancel_compile waits for us rather than
+            // letting the group (or its attribstate) be freed.
+            req.group->m_compile_running = true;
+        }
+
+        // optimize_group publishes the compiled function before marking
+        // the group optimized, so render threads that see it optimized
+        // can run it right away.
+        if (req.attribstate)
+            optimize_group (*req.attribstate, *req.group);
+        else
+            recompile_group (*req.group, true);
+
+        boost::unique_lock<boost::mutex> lock (m_compile_mutex);
+        req.group->m_compile_queued = false;
+        req.group->m_compile_running = false;
+        req.group->m_compile_owner = NULL;
+        --m_compile_pending;
+        {
+            spin_lock stat_lock (m_stat_mutex);
+            ++m_stat_async_compiles;
+        }
+        m_compile_done_cond.notify_all ();
+    }
+}
+
+
+
+void
+ShadingSystemImpl::stop_compile_threads ()
+{
+    {
+        boost::unique_lock<boost::mutex> lock (m_compile_mutex);
+        m_compile_shutdown = true;
+        // Abandon what hasn't been started; the groups remain
+        // unoptimized, exactly as if they had never been executed.
+        BOOST_FOREACH (CompileRequest &req, m_compile_queue) {
+            req.group->m_compile_queued = false;
+            req.group->m_compile_owner = NULL;
+        }
+        m_compile_pending -= (int) m_compile_queue.size();
+        m_compile_queue.clear ();
+        m_compile_cond.notify_all ();
+        m_compile_done_cond.notify_all ();
+    }
+    m_compile_threads.join_all ();
+}
+
+
+
+void
+ShadingSystemImpl::run_with_helpers (const boost::function<void()> &work,
+                                     int nhelpers)
+{
+    HelperJob job;
+    job.work = work;
+    job.running = 0;
+    {
+        boost::unique_lock<boost::mutex> lock (m_helper_mutex);
+        for ( ;  m_nhelper_threads < nhelpers;  ++m_nhelper_threads)
+            m_helper_threads.create_thread (
+                boost::bind (&ShadingSystemImpl::helper_thread_main, this));
+        for (int i = 0;  i < nhelpers;  ++i)
+            m_helper_queue.push_back (&job);
+    }
+    m_helper_cond.notify_all ();
+
+    // Don't wait on the helpers -- they may all be busy with other
+    // groups' work, or there may be none for us at all
+    work ();
+
+    boost::unique_lock<boost::mutex> lock (m_helper_mutex);
+    m_helper_queue.erase (std::remove (m_helper_queue.begin(),
+                                       m_helper_queue.end(), &job),
+                          m_helper_queue.end());
+    while (job.running)
+        m_helper_done_cond.wait (lock);
+}
+
+
+
+void
+ShadingSystemImpl::helper_thread_main ()
+{
+    for (;;) {
+        HelperJob *job;
+        {
+            boost::unique_lock<boost::mutex> lock (m_helper_mutex);
+            while (m_helper_queue.empty() && ! m_helper_shutdown)
+                m_helper_cond.wait (lock);
+            if (m_helper_shutdown)
+                return;
+            job = m_helper_queue.front ();
+            m_helper_queue.pop_front ();
+            ++job->running;
+        }
+
+        job->work ();
+
+        boost::unique_lock<boost::mutex> lock (m_helper_mutex);
+        --job->running;
+        m_helper_done_cond.notify_all ();
+    }
+}
+
+
+
+void
+ShadingSystemImpl::stop_helper_threads ()
+{
+    {
+        boost::unique_lock<boost::mutex> lock (m_helper_mutex);
+        m_helper_shutdown = true;
+        m_helper_cond.notify_all ();
+    }
+    m_helper_threads.join_all ();
 }
 
 
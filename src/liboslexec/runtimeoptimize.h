@@ -51,26 +51,40 @@ class RuntimeOptimizer {
 public:
     RuntimeOptimizer (ShadingSystemImpl &shadingsys, ShaderGroup &group)
         : m_shadingsys(shadingsys), m_group(group),
+          m_optimize(group.tier() == 0 ? std::min (shadingsys.optimize(), 1)
+                                       : shadingsys.optimize()),
           m_inst(NULL), m_next_newconst(0),
           m_stat_opt_locking_time(0), m_stat_specialization_time(0),
           m_stat_total_llvm_time(0), m_stat_llvm_setup_time(0),
           m_stat_llvm_irgen_time(0), m_stat_llvm_opt_time(0),
-          m_stat_llvm_jit_time(0)
-        , m_llvm_context(NULL), m_llvm_module(NULL), m_builder(NULL),
+          m_stat_llvm_jit_time(0), m_stat_groupdata_size(0),
+          m_stat_groupdata_hot_size(0), m_stat_groupdata_layers(0),
+          m_stat_cse_ops(0), m_stat_preopt_syms(0), m_stat_postopt_syms(0),
+          m_stat_preopt_ops(0), m_stat_postopt_ops(0)
+        , m_llvm_state(NULL), m_llvm_context(NULL), m_llvm_module(NULL),
+          m_builder(NULL),
           m_llvm_passes(NULL), m_llvm_func_passes(NULL),
-          m_llvm_func_passes_optimized(NULL)
+          m_llvm_func_passes_optimized(NULL),
+          m_llvm_relocatable(false), m_jitcache_ok(true),
+          m_llvm_quick(false)
     {
     }
 
     ~RuntimeOptimizer () {
         delete m_builder;
         delete m_llvm_passes;
+        for (size_t i = 0;  i < m_llvm_timed_passes.size();  ++i)
+            delete m_llvm_timed_passes[i].second;
         delete m_llvm_func_passes;
         delete m_llvm_func_passes_optimized;
     }
 
     void optimize_group ();
 
+    /// Check out LLVM state, then generate, optimize and JIT the code
+    /// for the group from its (already optimized) instances.
+    void llvm_compile_group ();
+
     /// Optimize one layer of a group, given what we know about its
     /// instance variables and connections.
     void optimize_instance ();
@@ -79,6 +93,14 @@ public:
     /// track variable lifetimes, coalesce temporaries.
     void post_optimize_instance ();
 
+    /// Finish optimizing one layer: post-optimization cleanup, then
+    /// discard its nops and unused symbols (or all its code if it's
+    /// unused).  Return the symbols and ops left in nsyms and nops.
+    /// Nothing here reads anything another layer's finish_layer
+    /// writes, so any number of layers may be finished in parallel,
+    /// each by its own RuntimeOptimizer.
+    void finish_layer (int layer, size_t &nsyms, size_t &nops);
+
     /// Set which instance we are currently optimizing.
     ///
     void set_inst (int layer);
@@ -93,6 +115,10 @@ public:
 
     ShadingSystemImpl &shadingsys () const { return m_shadingsys; }
 
+    /// Runtime optimization level for this group: the "optimize"
+    /// attribute, but no constant folding for first-tier groups.
+    int optimize () const { return m_optimize; }
+
     TextureSystem *texturesys () const { return shadingsys().texturesys(); }
 
     /// Search the instance for a constant whose type and value match
@@ -187,7 +213,9 @@ public:
     /// not already done.
     void add_useparam (SymbolPtrVec &allsyms);
 
-    void coalesce_temporaries ();
+    /// Merge temporaries whose lifetimes don't overlap, and return how
+    /// many were merged away.
+    int coalesce_temporaries ();
 
     /// Track variable lifetimes for all the symbols of the instance.
     ///
@@ -237,16 +265,88 @@ public:
     /// 
     int peephole2 (int opnum);
 
+    /// Is s an output param that nothing needs: not connected to a
+    /// later layer, and not among the outputs the renderer said it
+    /// reads?  Writes to those are as dead as writes to unread locals.
+    /// (If the renderer didn't name its outputs, all are needed.)
+    bool unneeded_output (const Symbol &s) const;
+
+    /// Within each basic block, turn pure ops that repeat an earlier
+    /// op with the same (unchanged) arguments into assignments from
+    /// the earlier result.  Return the number of ops changed.
+    int eliminate_common_subexpressions ();
+
     /// Helper: return the ptr to the symbol that is the argnum-th
     /// argument to the given op.
     Symbol *opargsym (const Opcode &op, int argnum) {
         return inst()->argsymbol (op.firstarg()+argnum);
     }
 
+    /// Throw away the symbols and code of the current instance, which
+    /// we've determined will never run.
+    void discard_instance_code ();
+
+    /// Compute the JIT cache key for the group: a hash of everything
+    /// that determines the code we'll generate for it -- the masters,
+    /// instance parameter values and connections, the options that
+    /// affect code generation, the registered closures, and the
+    /// OSL/LLVM build.
+    std::string jitcache_key () const;
+
+    /// Compute the key under which the first optimize_instance pass on
+    /// the current layer is memoized: a hash of its master, parameter
+    /// values and connections, the upstream outputs it is connected
+    /// to, which of its outputs are used downstream, and the messages
+    /// earlier layers may have set.
+    std::string specialization_key () const;
+
+    /// If a layer with the given specialization key was optimized
+    /// before, make the current instance just like it did after
+    /// its first optimize_instance pass, and return true.
+    bool reuse_specialization (const std::string &key);
+
+    /// Remember what optimize_instance just did to the current layer,
+    /// whose connections beforehand were given.
+    void remember_specialization (const std::string &key,
+                                  const ConnectionVec &connections);
+
+    /// Note which messages the current (optimized) layer may set, so
+    /// subsequent layers will know.
+    void note_messages_sent ();
+
+    /// Try to load the compiled group from the JIT cache.  If it was
+    /// found (and is valid), set up the group and its instances just
+    /// as if we had optimized and JITed it, and return true.
+    bool jitcache_load ();
+
+    /// Write the fully-optimized (but not yet JITed) module, and the
+    /// group data layout, to the JIT cache.  funcs[0..nfuncs-1] are the
+    /// layer functions, the last one being the group entry point.
+    void jitcache_store (llvm::Function **funcs, int nfuncs);
+
+    /// Return the address in this process corresponding to a
+    /// relocatable external name created by llvm_external_ptr, or NULL
+    /// if it can't be resolved.
+    void *jitcache_resolve (const std::string &name) const;
+
+    /// Are we generating relocatable code (no embedded addresses), so
+    /// that the result may be saved in the JIT cache?
+    bool llvm_relocatable () const { return m_llvm_relocatable; }
+
+    /// Note that the code we're generating necessarily depends on
+    /// something that only exists in this process, and so must not be
+    /// saved to the JIT cache.
+    void mark_uncacheable () { m_jitcache_ok = false; }
+
     /// Create an llvm function for the whole shader group, JIT it,
     /// and store the llvm::Function* handle to it with the ShaderGroup.
     void build_llvm_group ();
 
+    /// JIT the group's entry function (and everything it calls) with
+    /// the engine we've checked out, hand the group the memory it went
+    /// into, and return the code pointer.
+    RunLLVMGroupFunc llvm_jit_group (llvm::Function *entry);
+
     int layer_remap (int origlayer) const { return m_layer_remap[origlayer]; }
 
     /// Set up a bunch of static things we'll need for the whole group.
@@ -449,6 +549,18 @@ public:
     /// representation of a TypeDesc.
     llvm::Value *llvm_constant (const TypeDesc &type);
 
+    /// Return a pointer (of the given type) to addr, which must be
+    /// uniquely identified by name.  When generating relocatable code,
+    /// this is a reference to an external symbol of that name that is
+    /// bound to addr at JIT time, rather than the literal address.
+    llvm::Value *llvm_external_ptr (void *addr, const std::string &name,
+                                    const llvm::PointerType *type);
+
+    /// Return a void pointer to len bytes of constant data.  When
+    /// generating relocatable code, the data are copied into the
+    /// module rather than referenced by address.
+    llvm::Value *llvm_constant_bytes_ptr (const void *data, size_t len);
+
     /// Generate LLVM code to zero out the variable (including derivs)
     ///
     void llvm_assign_zero (const Symbol &sym);
@@ -541,13 +653,28 @@ public:
 
     void llvm_setup_optimization_passes ();
 
+    /// Add pass to the LLVM module passes.  With "pass_stats", it gets
+    /// a pass manager of its own, so that it can be timed by itself.
+    void llvm_add_pass (llvm::Pass *pass, const char *name);
+
     /// Do LLVM optimization on the partcular function func.  If
     /// interproc is true, also do full interprocedural optimization.
     void llvm_do_optimization (llvm::Function *func, bool interproc=false);
 
+    /// Add a run of the named pass, which took time and made the given
+    /// number of changes, to our per-pass stats.
+    void add_pass_stats (const char *name, double time, long long changes) {
+        pvt::add_pass_stats (m_pass_stats, name, time, changes);
+    }
+
+    /// Our per-pass stats (only collected if the shading system's
+    /// "pass_stats" attribute is set).
+    const PassStatsVec &pass_stats () const { return m_pass_stats; }
+
 private:
     ShadingSystemImpl &m_shadingsys;
     ShaderGroup &m_group;             ///< Group we're optimizing
+    int m_optimize;                   ///< Runtime optimization level
     int m_layer;                      ///< Layer we're optimizing
     ShaderInstance *m_inst;           ///< Instance we're optimizing
 
@@ -569,8 +696,18 @@ private:
     double m_stat_llvm_irgen_time;        ///<     llvm IR generation time
     double m_stat_llvm_opt_time;          ///<     llvm IR optimization time
     double m_stat_llvm_jit_time;          ///<     llvm JIT time
+    size_t m_stat_groupdata_size;         ///< Group data bytes per point
+    size_t m_stat_groupdata_hot_size;     ///<   ... used by the code
+    int m_stat_groupdata_layers;          ///< Layers with group data
+    int m_stat_cse_ops;                   ///< Ops replaced by earlier results
+    long long m_stat_preopt_syms;         ///< Symbols before optimizing
+    long long m_stat_postopt_syms;        ///<   ... and after
+    long long m_stat_preopt_ops;          ///< Ops before optimizing
+    long long m_stat_postopt_ops;         ///<   ... and after
+    PassStatsVec m_pass_stats;            ///< Time and changes per pass
 
     // LLVM stuff
+    LLVMJitState *m_llvm_state;         ///< LLVM state we've checked out
     llvm::LLVMContext *m_llvm_context;
     llvm::Module *m_llvm_module;
     AllocationMap m_named_values;
@@ -602,6 +739,14 @@ private:
     llvm::PassManager *m_llvm_passes;
     llvm::FunctionPassManager *m_llvm_func_passes;
     llvm::FunctionPassManager *m_llvm_func_passes_optimized;
+    /// With "pass_stats", each LLVM pass (and its name) by itself
+    std::vector<std::pair<const char *,llvm::PassManager *> > m_llvm_timed_passes;
+    bool m_llvm_relocatable;          ///< Don't embed addresses in the IR
+    bool m_jitcache_ok;               ///< Ok to save this group to the cache
+    std::string m_jitcache_key;       ///< JIT cache key for this group
+    std::map<std::string,void*> m_llvm_external_addrs; ///< Names -> addrs
+    std::map<std::pair<const void*,size_t>,llvm::Constant*> m_llvm_const_data;
+    bool m_llvm_quick;                ///< Quick first-tier LLVM passes only
 
     // Persistant data shared between layers
     bool m_unknown_message_sent;      ///< Somebody did a non-const setmessage
@@ -138,23 +138,47 @@ ShadingSystemImpl::ShadingSystemImpl (RendererServices *renderer,
     : m_renderer(renderer), m_texturesys(texturesystem), m_err(err),
       m_statslevel (0), m_debug (false), m_lazylayers (true),
       m_lazyglobals (false),
-      m_clearmemory (false), m_rebind (false), m_debugnan (false),
+      m_clearmemory (false), m_clearmemory_partial (true),
+      m_rebind (false), m_debugnan (false),
       m_lockgeom_default (false), m_optimize (1),
       m_llvm_debug(false),
-      m_commonspace_synonym("world"),
+      m_commonspace_synonym("world"), m_async_compile(0), m_optimize_threads(0),
+      m_tier_threshold(0), m_dedup_groups(true), m_inline_layers(false),
+      m_memoize_instances(false), m_max_userdata_groups(0),
+      m_pass_stats(false),
+      m_raytype_variants(0), m_noderivs_variants(false), m_perf_map(false), m_perf_map_file(NULL),
       m_in_group (false),
       m_global_heap_total (0),
       m_stat_opt_locking_time(0), m_stat_specialization_time(0),
       m_stat_total_llvm_time(0),
       m_stat_llvm_setup_time(0), m_stat_llvm_irgen_time(0),
       m_stat_llvm_opt_time(0), m_stat_llvm_jit_time(0),
-      m_llvm_context (NULL),
-      m_llvm_module (NULL),
-      m_llvm_exec (NULL),
-      m_llvm_jitmm (NULL)
+      m_stat_llvm_ops_parse_time(0), m_stat_llvm_ops_clone_time(0),
+      m_stat_llvm_ops_parses(0), m_stat_llvm_ops_clones(0),
+      m_stat_jitcache_hits(0), m_stat_jitcache_misses(0),
+      m_stat_jitcache_stores(0), m_stat_jitcache_uncacheable(0),
+      m_stat_groups_compiled(0),
+      m_stat_jitcache_load_time(0), m_stat_async_compiles(0),
+      m_stat_tier_recompiles(0), m_stat_tier_recompile_time(0),
+      m_stat_dedup_hits(0), m_stat_dedup_misses(0), m_stat_dedup_mem_saved(0),
+      m_stat_groupdata_groups(0), m_stat_groupdata_layers(0),
+      m_stat_groupdata_size(0), m_stat_groupdata_hot_size(0),
+      m_stat_groupdata_max(0), m_stat_cse_ops(0),
+      m_stat_preopt_syms(0), m_stat_postopt_syms(0),
+      m_stat_preopt_ops(0), m_stat_postopt_ops(0),
+      m_stat_instance_memo_hits(0), m_stat_instance_memo_misses(0),
+      m_stat_userdata_groups(0), m_stat_userdata_params(0),
+      m_stat_group_variants(0), m_stat_mem_jit_freed(0),
+      m_compile_pending(0), m_compile_shutdown(false),
+      m_ncompile_threads(0), m_helper_shutdown(false), m_nhelper_threads(0),
+      m_specialized_instances_mem(0),
+      m_llvm_jitmm(NULL)
 {
+    m_jit_epoch = 0;
     m_stat_shaders_loaded = 0;
     m_stat_shaders_requested = 0;
+    m_stat_master_parse_time = 0;
+    m_stat_master_parse_max = 0;
     m_stat_groups = 0;
     m_stat_groupinstances = 0;
     m_stat_regexes = 0;
@@ -169,6 +193,8 @@ ShadingSystemImpl::ShadingSystemImpl (RendererServices *renderer,
     m_stat_total_syms = 0;
     m_stat_syms_with_derivs = 0;
     m_stat_optimization_time = 0;
+    m_stat_deferred_executions = 0;
+    m_stat_group_variant_points = 0;
 
     init_global_heap_offsets ();
 
@@ -230,20 +256,35 @@ ShadingSystemImpl::register_closure(const char *name, int id, const ClosureParam
 
 ShadingSystemImpl::~ShadingSystemImpl ()
 {
+    // Background compiles use the LLVM states (and the optimize
+    // helpers), so must finish first
+    stop_compile_threads ();
+    stop_helper_threads ();
     printstats ();
+    if (m_perf_map_file)
+        fclose (m_perf_map_file);
     // N.B. just let m_texsys go -- if we asked for one to be created,
     // we asked for a shared one.
 
-    delete m_llvm_exec;
-    // NOTE(boulos): Deleting the execution engine should in theory
-    // clean up the module. Calling delete on the module here results
-    // in a crash (suggesting theory meets practice).
+    BOOST_FOREACH (LLVMJitState *state, m_llvm_states) {
+        delete state->exec;
+        // NOTE(boulos): Deleting the execution engine should in theory
+        // clean up the module. Calling delete on the module here results
+        // in a crash (suggesting theory meets practice).
 
-    // delete m_llvm_module;
+        // delete state->module;
 
-    delete m_llvm_context;
+        // The parsed ops module is not owned by any EE, so we must free
+        // it ourselves, before the context it lives in.
+        delete state->ops_module;
 
-    // Delete the retained JIT memory manager
+        delete state->context;
+        delete state;
+    }
+
+    // Nothing can be running any code by now
+    for (size_t i = 0;  i < m_retired_jit_memory.size();  ++i)
+        delete m_retired_jit_memory[i].second;
     delete m_llvm_jitmm;
 
     // FIXME(boulos): According to the docs, we should also call
@@ -287,6 +328,10 @@ ShadingSystemImpl::attribute (const std::string &name, TypeDesc type,
         m_clearmemory = *(const int *)val;
         return true;
     }
+    if (name == "clearmemory_partial" && type == TypeDesc::INT) {
+        m_clearmemory_partial = *(const int *)val;
+        return true;
+    }
     if (name == "rebind" && type == TypeDesc::INT) {
         m_rebind = *(const int *)val;
         return true;
@@ -311,6 +356,60 @@ ShadingSystemImpl::attribute (const std::string &name, TypeDesc type,
         m_commonspace_synonym = ustring (*(const char **)val);
         return true;
     }
+    if (name == "cachedir" && type == TypeDesc::STRING) {
+        m_cachedir = std::string (*(const char **)val);
+        return true;
+    }
+    if (name == "raytype_variants" && type == TypeDesc::INT) {
+        m_raytype_variants = std::max (0, *(const int *)val);
+        return true;
+    }
+    if (name == "noderivs_variants" && type == TypeDesc::INT) {
+        m_noderivs_variants = *(const int *)val;
+        return true;
+    }
+    if (name == "perf_map" && type == TypeDesc::INT) {
+        m_perf_map = *(const int *)val;
+        return true;
+    }
+    if (name == "async_compile" && type == TypeDesc::INT) {
+        m_async_compile = std::max (0, *(const int *)val);
+        return true;
+    }
+    if (name == "optimize_threads" && type == TypeDesc::INT) {
+        m_optimize_threads = std::max (0, *(const int *)val);
+        return true;
+    }
+    if (name == "inline_layers" && type == TypeDesc::INT) {
+        m_inline_layers = *(const int *)val;
+        return true;
+    }
+    if (name == "memoize_instances" && type == TypeDesc::INT) {
+        m_memoize_instances = *(const int *)val;
+        return true;
+    }
+    if (name == "max_userdata_groups" && type == TypeDesc::INT) {
+        m_max_userdata_groups = std::max (0, *(const int *)val);
+        return true;
+    }
+    if (name == "pass_stats" && type == TypeDesc::INT) {
+        m_pass_stats = *(const int *)val;
+        return true;
+    }
+    if (name == "dedup_groups" && type == TypeDesc::INT) {
+        m_dedup_groups = *(const int *)val;
+        return true;
+    }
+    if (name == "tier_threshold" && type == TypeDesc::INT) {
+        m_tier_threshold = std::max (0, *(const int *)val);
+        return true;
+    }
+    if (name == "renderer_outputs" && type.basetype == TypeDesc::STRING) {
+        m_renderer_outputs.clear ();
+        for (size_t i = 0;  i < type.numelements();  ++i)
+            m_renderer_outputs.push_back (ustring(((const char **)val)[i]));
+        return true;
+    }
     if (name == "raytypes" && type.basetype == TypeDesc::STRING) {
         ASSERT (type.numelements() <= 32 &&
                 "ShaderGlobals.raytype is an int, max of 32 raytypes");
@@ -339,22 +438,93 @@ ShadingSystemImpl::getattribute (const std::string &name, TypeDesc type,
         *(const char **)val = m_searchpath.c_str();
         return true;
     }
+    if (name == "cachedir" && type == TypeDesc::STRING) {
+        *(const char **)val = m_cachedir.c_str();
+        return true;
+    }
     ATTR_DECODE ("statistics:level", int, m_statslevel);
     ATTR_DECODE ("debug", int, m_debug);
     ATTR_DECODE ("lazylayers", int, m_lazylayers);
     ATTR_DECODE ("lazyglobals", int, m_lazyglobals);
     ATTR_DECODE ("clearmemory", int, m_clearmemory);
+    ATTR_DECODE ("clearmemory_partial", int, m_clearmemory_partial);
     ATTR_DECODE ("rebind", int, m_rebind);
     ATTR_DECODE ("debugnan", int, m_debugnan);
     ATTR_DECODE ("lockgeom", int, m_lockgeom_default);
     ATTR_DECODE ("optimize", int, m_optimize);
     ATTR_DECODE ("llvm_debug", int, m_llvm_debug);
+    ATTR_DECODE ("async_compile", int, m_async_compile);
+    ATTR_DECODE ("optimize_threads", int, m_optimize_threads);
+    ATTR_DECODE ("tier_threshold", int, m_tier_threshold);
+    ATTR_DECODE ("dedup_groups", int, m_dedup_groups);
+    ATTR_DECODE ("inline_layers", int, m_inline_layers);
+    ATTR_DECODE ("memoize_instances", int, m_memoize_instances);
+    ATTR_DECODE ("max_userdata_groups", int, m_max_userdata_groups);
+    ATTR_DECODE ("pass_stats", int, m_pass_stats);
+    ATTR_DECODE ("perf_map", int, m_perf_map);
+    ATTR_DECODE ("raytype_variants", int, m_raytype_variants);
+    ATTR_DECODE ("noderivs_variants", int, m_noderivs_variants);
     ATTR_DECODE ("stat:masters", int, m_stat_shaders_loaded);
+    ATTR_DECODE ("stat:master_parse_time", float, m_stat_master_parse_time);
     ATTR_DECODE ("stat:groups", int, m_stat_groups);
     ATTR_DECODE ("stat:instances", int, m_stat_groupinstances);
     ATTR_DECODE ("stat:memory_current", long long, m_stat_memory.current());
     ATTR_DECODE ("stat:memory_peak", long long, m_stat_memory.peak());
+    ATTR_DECODE ("stat:jit_memory_current", long long, m_stat_mem_jit.current());
+    ATTR_DECODE ("stat:jit_memory_peak", long long, m_stat_mem_jit.peak());
+    ATTR_DECODE ("stat:jit_memory_freed", long long, m_stat_mem_jit_freed);
     ATTR_DECODE ("stat:optimization_time", float, m_stat_optimization_time);
+    ATTR_DECODE ("stat:jitcache_hits", int, m_stat_jitcache_hits);
+    ATTR_DECODE ("stat:jitcache_misses", int, m_stat_jitcache_misses);
+    ATTR_DECODE ("stat:jitcache_stores", int, m_stat_jitcache_stores);
+    ATTR_DECODE ("stat:jitcache_load_time", float, m_stat_jitcache_load_time);
+    ATTR_DECODE ("stat:groups_compiled", int, m_stat_groups_compiled);
+    ATTR_DECODE ("stat:async_compiles", int, m_stat_async_compiles);
+    ATTR_DECODE ("stat:deferred_executions", long long, m_stat_deferred_executions);
+    ATTR_DECODE ("stat:tier_recompiles", int, m_stat_tier_recompiles);
+    ATTR_DECODE ("stat:groupdata_size", long long, m_stat_groupdata_size);
+    ATTR_DECODE ("stat:groupdata_hot_size", long long, m_stat_groupdata_hot_size);
+    ATTR_DECODE ("stat:groupdata_max", long long, m_stat_groupdata_max);
+    ATTR_DECODE ("stat:cse_ops", int, m_stat_cse_ops);
+    ATTR_DECODE ("stat:preopt_syms", long long, m_stat_preopt_syms);
+    ATTR_DECODE ("stat:postopt_syms", long long, m_stat_postopt_syms);
+    ATTR_DECODE ("stat:preopt_ops", long long, m_stat_preopt_ops);
+    ATTR_DECODE ("stat:postopt_ops", long long, m_stat_postopt_ops);
+    ATTR_DECODE ("stat:instance_memo_hits", int, m_stat_instance_memo_hits);
+    ATTR_DECODE ("stat:instance_memo_misses", int, m_stat_instance_memo_misses);
+    ATTR_DECODE ("stat:userdata_groups", int, m_stat_userdata_groups);
+    ATTR_DECODE ("stat:userdata_params", int, m_stat_userdata_params);
+
+    // Per-pass stats, as arrays with one entry per pass, in the order
+    // the passes first ran.  Ask for "stat:npasses" to size them.
+    {
+        spin_lock lock (m_stat_mutex);
+        const PassStatsVec &passes (m_stat_passes);
+        int npasses = (int) passes.size();
+        ATTR_DECODE ("stat:npasses", int, npasses);
+        if (name.compare (0, 10, "stat:pass_") == 0 &&
+              type.arraylen == npasses && npasses > 0) {
+            for (int i = 0;  i < npasses;  ++i) {
+                const PassStats &p (passes[i]);
+                if (name == "stat:pass_names" && type.basetype == TypeDesc::STRING)
+                    ((const char **)val)[i] = ustring(p.name).c_str();
+                else if (name == "stat:pass_times" && type.basetype == TypeDesc::FLOAT)
+                    ((float *)val)[i] = (float) p.time;
+                else if (name == "stat:pass_runs" && type.basetype == TypeDesc::INT)
+                    ((int *)val)[i] = (int) p.runs;
+                else if (name == "stat:pass_changes" && type.basetype == TypeDesc::INT)
+                    ((int *)val)[i] = (int) p.changes;
+                else
+                    return false;
+            }
+            return true;
+        }
+    }
+    ATTR_DECODE ("stat:group_variants", int, m_stat_group_variants);
+    ATTR_DECODE ("stat:group_variant_points", long long, m_stat_group_variant_points);
+    ATTR_DECODE ("stat:dedup_hits", int, m_stat_dedup_hits);
+    ATTR_DECODE ("stat:dedup_misses", int, m_stat_dedup_misses);
+    ATTR_DECODE ("stat:dedup_mem_saved", long long, m_stat_dedup_mem_saved);
     
     return false;
 #undef ATTR_DECODE
@@ -477,6 +647,15 @@ ShadingSystemImpl::getstats (int level) const
     out << "    Requested: " << m_stat_shaders_requested << "\n";
     out << "    Loaded:    " << m_stat_shaders_loaded << "\n";
     out << "    Masters:   " << m_stat_shaders_loaded << "\n";
+    if (m_stat_shaders_loaded) {
+        out << "    Parse time: "
+            << Strutil::timeintervalformat (m_stat_master_parse_time, 2)
+            << " (avg " << Strutil::timeintervalformat (
+                   m_stat_master_parse_time / m_stat_shaders_loaded, 2)
+            << ", slowest " << m_stat_master_parse_slowest << " "
+            << Strutil::timeintervalformat (m_stat_master_parse_max, 2)
+            << ")\n";
+    }
     out << "    Instances: " << m_stat_instances << "\n";
     out << "  Shading contexts: " << m_stat_contexts << "\n";
     out << "  Shading groups:   " << m_stat_groups << "\n";
@@ -484,6 +663,30 @@ ShadingSystemImpl::getstats (int level) const
     float iperg = (float)m_stat_groupinstances/std::max(m_stat_groups,1);
     out << "    Avg instances per group: " 
         << Strutil::format ("%.1f", iperg) << "\n";
+    out << "    Groups compiled: " << m_stat_groups_compiled << "\n";
+    if (m_dedup_groups) {
+        out << "    Identical groups shared: " << m_stat_dedup_hits << " / "
+            << (m_stat_dedup_hits + m_stat_dedup_misses) << " (saved "
+            << Strutil::memformat (m_stat_dedup_mem_saved) << ")\n";
+    }
+    if (m_stat_groupdata_groups) {
+        int ngroups = m_stat_groupdata_groups;
+        out << Strutil::format ("    Group data per point: avg %s (%s used by code), max %s\n",
+                 Strutil::memformat (m_stat_groupdata_size/ngroups).c_str(),
+                 Strutil::memformat (m_stat_groupdata_hot_size/ngroups).c_str(),
+                 Strutil::memformat (m_stat_groupdata_max).c_str());
+        out << Strutil::format ("      avg per layer: %s\n",
+                 Strutil::memformat (m_stat_groupdata_size/std::max(m_stat_groupdata_layers,1)).c_str());
+    }
+    if (m_stat_userdata_groups) {
+        out << "    Specialized for constant userdata: " << m_stat_userdata_groups
+            << " (" << m_stat_userdata_params << " params folded)\n";
+    }
+    if (m_raytype_variants || m_noderivs_variants) {
+        out << "    Group variants: " << m_stat_group_variants
+            << Strutil::format (" (ran %lld points)\n",
+                                (long long)m_stat_group_variant_points);
+    }
 
     long long totalexec = m_layers_executed_uncond + m_layers_executed_lazy +
                           m_layers_executed_never;
@@ -519,9 +722,38 @@ ShadingSystemImpl::getstats (int level) const
         << Strutil::timeintervalformat (m_stat_opt_locking_time, 2) << "\n";
     out << "    runtime specialization:    "
         << Strutil::timeintervalformat (m_stat_specialization_time, 2) << "\n";
+    if (m_stat_preopt_ops)
+        out << Strutil::format ("      symbols:                 %lld -> %lld (%.1f%%)\n"
+                                "      ops:                     %lld -> %lld (%.1f%%)\n",
+                                m_stat_preopt_syms, m_stat_postopt_syms,
+                                100.0 * m_stat_postopt_syms / std::max (m_stat_preopt_syms, 1LL),
+                                m_stat_preopt_ops, m_stat_postopt_ops,
+                                100.0 * m_stat_postopt_ops / std::max (m_stat_preopt_ops, 1LL));
+    if (m_stat_cse_ops)
+        out << "      common subexpressions:   " << m_stat_cse_ops
+            << " ops eliminated\n";
+    if (m_memoize_instances)
+        out << "      reused specializations:  " << m_stat_instance_memo_hits
+            << " / " << (m_stat_instance_memo_hits + m_stat_instance_memo_misses)
+            << " layers (holding "
+            << Strutil::memformat (m_specialized_instances_mem) << ")\n";
     if (m_stat_total_llvm_time > 0.0) {
         out << "    LLVM setup:                "
             << Strutil::timeintervalformat (m_stat_llvm_setup_time, 2) << "\n";
+        if (m_stat_llvm_ops_clones) {
+            // Every clone beyond the one-time parse for each LLVM state
+            // would otherwise have been a full parse.
+            double parsetime = m_stat_llvm_ops_parse_time / std::max (m_stat_llvm_ops_parses, 1);
+            double saved = parsetime * (m_stat_llvm_ops_clones - m_stat_llvm_ops_parses)
+                           - m_stat_llvm_ops_clone_time;
+            out << "      ops bitcode parse:       "
+                << Strutil::timeintervalformat (m_stat_llvm_ops_parse_time, 2)
+                << " (" << m_stat_llvm_ops_parses << " LLVM contexts)\n";
+            out << "      ops module clones:       " << m_stat_llvm_ops_clones
+                << " (" << Strutil::timeintervalformat (m_stat_llvm_ops_clone_time, 2)
+                << ", saved ~" << Strutil::timeintervalformat (std::max (saved, 0.0), 2)
+                << " vs. re-parsing)\n";
+        }
         out << "    LLVM IR gen:               "
             << Strutil::timeintervalformat (m_stat_llvm_irgen_time, 2) << "\n";
         out << "    LLVM optimize:             "
@@ -529,6 +761,37 @@ ShadingSystemImpl::getstats (int level) const
         out << "    LLVM JIT:                  "
             << Strutil::timeintervalformat (m_stat_llvm_jit_time, 2) << "\n";
     }
+    if (m_stat_passes.size()) {
+        // Our passes report ops changed (or symbols or ops removed),
+        // LLVM's report the net number of instructions removed.
+        out << "  Optimization passes:           time       runs    changes\n";
+        BOOST_FOREACH (const PassStats &p, m_stat_passes)
+            out << Strutil::format ("    %-24s %10s %10lld %10lld\n",
+                     p.name.c_str(),
+                     Strutil::timeintervalformat (p.time, 2).c_str(),
+                     p.runs, p.changes);
+    }
+    if (m_stat_async_compiles || m_stat_deferred_executions) {
+        out << "  Background compiles: " << m_stat_async_compiles
+            << " (" << m_ncompile_threads << " threads)\n";
+        out << Strutil::format ("    Points deferred awaiting compile:  %lld\n",
+                                (long long)m_stat_deferred_executions);
+    }
+    if (m_tier_threshold > 0) {
+        out << "  Hot groups recompiled: " << m_stat_tier_recompiles << " ("
+            << Strutil::timeintervalformat (m_stat_tier_recompile_time, 2)
+            << ", threshold " << m_tier_threshold << " points)\n";
+    }
+    if (m_cachedir.size()) {
+        out << "  JIT cache (" << m_cachedir << "):\n";
+        out << "    hits:   " << m_stat_jitcache_hits << " ("
+            << Strutil::timeintervalformat (m_stat_jitcache_load_time, 2)
+            << " loading)\n";
+        out << "    misses: " << m_stat_jitcache_misses << "\n";
+        out << "    stores: " << m_stat_jitcache_stores << "\n";
+        if (m_stat_jitcache_uncacheable)
+            out << "    uncacheable groups: " << m_stat_jitcache_uncacheable << "\n";
+    }
 
     out << "  Regex's compiled: " << m_stat_regexes << "\n";
 
@@ -546,12 +809,9 @@ ShadingSystemImpl::getstats (int level) const
     out << "        Instance param values: " << m_stat_mem_inst_paramvals.memstat() << '\n';
     out << "        Instance connections:  " << m_stat_mem_inst_connections.memstat() << '\n';
 
-    if (m_llvm_jitmm) {
-        size_t jitmem = m_llvm_jitmm->GetDefaultCodeSlabSize() * m_llvm_jitmm->GetNumCodeSlabs()
-            + m_llvm_jitmm->GetDefaultDataSlabSize() * m_llvm_jitmm->GetNumDataSlabs()
-            + m_llvm_jitmm->GetDefaultStubSlabSize() * m_llvm_jitmm->GetNumStubSlabs();
-        out << "    LLVM JIT memory: " << Strutil::memformat(jitmem) << '\n';
-    }
+    out << "    LLVM JIT memory: " << m_stat_mem_jit.memstat() << '\n';
+    out << "        Freed with groups:     "
+        << Strutil::memformat (m_stat_mem_jit_freed) << '\n';
 
     return out.str();
 }
@@ -581,6 +841,37 @@ ShadingSystemImpl::Parameter (const char *name, TypeDesc t, const void *val)
 
 
 
+bool
+ShadingSystemImpl::InteractiveParameter (const char *name, TypeDesc t,
+                                         const void *val)
+{
+    Parameter (name, t, val);
+    m_pending_interactive.push_back (ustring (name));
+    return true;
+}
+
+
+
+bool
+ShadingSystemImpl::ConstantUserdata (const char *name, TypeDesc t,
+                                     const void *val)
+{
+    // Make sure we have a current attrib state, and that nobody else
+    // is hanging onto it.
+    if (! m_curattrib)
+        m_curattrib.reset (new ShadingAttribState);
+    if (! m_curattrib.unique ()) {
+        ShadingAttribStateRef newstate (new ShadingAttribState (*m_curattrib));
+        m_curattrib = newstate;
+    }
+    ParamValueList &userdata (m_curattrib->constant_userdata ());
+    userdata.resize (userdata.size() + 1);
+    userdata.back().init (name, t, 1, val);
+    return true;
+}
+
+
+
 bool
 ShadingSystemImpl::ShaderGroupBegin (void)
 {
@@ -674,11 +965,17 @@ ShadingSystemImpl::Shader (const char *shaderusage,
     ShaderInstanceRef instance (new ShaderInstance (master, layername));
     instance->parameters (m_pending_params);
     m_pending_params.clear ();
+    BOOST_FOREACH (ustring name, m_pending_interactive)
+        if (! instance->make_interactive (name))
+            warning ("\"%s\" can't be an interactive parameter of shader \"%s\"",
+                     name.c_str(), shadername);
+    m_pending_interactive.clear ();
 
     ShaderGroup &shadergroup (m_curattrib->shadergroup (use));
     if (! m_in_group || m_group_use == ShadUseUnknown) {
         // A singleton, or the first in a group
         shadergroup.clear ();
+        shadergroup.renderer_outputs (m_renderer_outputs);
         m_stat_groups += 1;
     }
     if (m_in_group) {
@@ -800,6 +1097,25 @@ ShadingSystemImpl::clear_state ()
 
 
 
+bool
+ShadingSystemImpl::ReParameter (ShadingAttribStateRef &attribstate,
+                                const char *layername, const char *paramname,
+                                TypeDesc t, const void *val)
+{
+    ustring layer (layername), param (paramname);
+    bool found = false;
+    for (int use = 0;  use < (int)ShadUseLast;  ++use) {
+        ShaderGroup &group (attribstate->shadergroup ((ShaderUse)use));
+        found |= group.reparameter (layer, param, t, val);
+    }
+    if (! found)
+        error ("ReParameter: layer \"%s\" has no interactive %s parameter \"%s\"",
+               layername, t.c_str(), paramname);
+    return found;
+}
+
+
+
 
 void*
 ShadingSystemImpl::create_thread_info()
@@ -822,11 +1138,16 @@ ShadingContext *
 ShadingSystemImpl::get_context (void* thread_info)
 {
     PerThreadInfo *threadinfo = thread_info == NULL ? get_perthread_info () : (PerThreadInfo*) thread_info;
+    ShadingContext *sc;
     if (threadinfo->context_pool.empty()) {
-        return new ShadingContext (*this);
+        sc = new ShadingContext (*this);
     } else {
-        return threadinfo->pop_context ();
+        sc = threadinfo->pop_context ();
     }
+    spin_lock lock (m_jit_epoch_mutex);
+    sc->jit_epoch (m_jit_epoch);
+    ++m_context_epochs[m_jit_epoch];
+    return sc;
 }
 
 
@@ -835,7 +1156,19 @@ void
 ShadingSystemImpl::release_context (ShadingContext *sc, void* thread_info)
 {
     PerThreadInfo *threadinfo = thread_info == NULL ? get_perthread_info () : (PerThreadInfo*) thread_info;
+    sc->flush_execution_count ();
     threadinfo->context_pool.push (sc);
+    bool retired;
+    {
+        spin_lock lock (m_jit_epoch_mutex);
+        std::map<long long,int>::iterator found =
+            m_context_epochs.find (sc->jit_epoch ());
+        if (--found->second == 0)
+            m_context_epochs.erase (found);
+        retired = ! m_retired_jit_memory.empty ();
+    }
+    if (retired)
+        free_retired_llvm_jit_memory ();
 }
 
 
@@ -49,6 +49,14 @@ namespace pvt {   // OSL::pvt
 
 
 
+// Shaders may be loaded (and their structs registered) by several
+// threads at once, while others are optimizing or compiling shaders
+// that look up their structs, so the list is guarded.  The StructSpecs
+// themselves don't move when the list grows.
+static spin_mutex struct_list_mutex;
+
+
+
 std::vector<shared_ptr<StructSpec> > &
 TypeSpec::struct_list ()
 {
@@ -68,9 +76,37 @@ TypeSpec::TypeSpec (const char *name, int structid, int arraylen)
 
 
 
+StructSpec *
+TypeSpec::structspec (int id)
+{
+    if (! id)
+        return NULL;
+    spin_lock lock (struct_list_mutex);
+    return struct_list()[id].get();
+}
+
+
+
+/// Add n to the struct list and return its id.  The caller must hold
+/// struct_list_mutex.
+static int
+add_struct (StructSpec *n)
+{
+    std::vector<shared_ptr<StructSpec> > & m_structs (TypeSpec::struct_list());
+    if (m_structs.size() == 0)
+        m_structs.resize (1);   // Allocate an empty one
+    ASSERT (m_structs.size() < 0x8000 && "more struct id's than fit in a short!");
+    m_structs.push_back (shared_ptr<StructSpec>(n));
+    return (int)m_structs.size()-1;
+}
+
+
+
 int
 TypeSpec::structure_id (const char *name, bool add)
 {
+    // Look it up and add it in one go, lest two threads both add it
+    spin_lock lock (struct_list_mutex);
     std::vector<shared_ptr<StructSpec> > & m_structs (struct_list());
     ustring n (name);
     for (int i = (int)m_structs.size()-1;  i > 0;  --i) {
@@ -78,11 +114,8 @@ TypeSpec::structure_id (const char *name, bool add)
         if (m_structs[i] && m_structs[i]->name() == n)
             return i;
     }
-    if (add) {
-        ASSERT (m_structs.size() < 0x8000 && "more struct id's than fit in a short!");
-        int id = new_struct (new StructSpec (n, 0));
-        return id;
-    }
+    if (add)
+        return add_struct (new StructSpec (n, 0));
     return 0;   // Not found, not added
 }
 
@@ -91,11 +124,17 @@ TypeSpec::structure_id (const char *name, bool add)
 int
 TypeSpec::new_struct (StructSpec *n)
 {
-    std::vector<shared_ptr<StructSpec> > & m_structs (struct_list());
-    if (m_structs.size() == 0)
-        m_structs.resize (1);   // Allocate an empty one
-    m_structs.push_back (shared_ptr<StructSpec>(n));
-    return (int)m_structs.size()-1;
+    spin_lock lock (struct_list_mutex);
+    return add_struct (n);
+}
+
+
+
+StructSpec *
+TypeSpec::last_struct ()
+{
+    spin_lock lock (struct_list_mutex);
+    return struct_list().back().get();
 }
 
 
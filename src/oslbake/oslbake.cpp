@@ -0,0 +1,256 @@
+/*
+Copyright (c) 2009-2010 Sony Pictures Imageworks Inc., et al.
+All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+* Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+* Neither the name of Sony Pictures Imageworks nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * oslbake -- compile shader groups ahead of time into a JIT cache
+ *
+ * Each line of a group file describes one shader group, using the same
+ * arguments as testshade:
+ *
+ *   --layer a --fparam Kd 0.5 matte --layer b emitter --connect a Cout b Cin
+ *
+ * Blank lines and lines starting with '#' are ignored.  Every group is
+ * fully optimized and saved in the cache directory, so that a renderer
+ * that sets the same "cachedir" (and the same options) loads the
+ * compiled groups instead of optimizing them while it renders.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <OpenImageIO/argparse.h>
+#include <OpenImageIO/strutil.h>
+#include <OpenImageIO/timer.h>
+
+#include "oslexec.h"
+#include "../liboslexec/oslexec_pvt.h"
+#include "../testshade/simplerend.h"
+using namespace OSL;
+using namespace OSL::pvt;
+
+#ifdef OIIO_NAMESPACE
+using OIIO::ArgParse;
+using OIIO::Timer;
+#endif
+
+
+
+static ShadingSystem *shadingsys = NULL;
+static std::vector<std::string> groupfiles;
+static std::string cachedir;
+static std::string raytypes;
+static bool debug = false;
+static bool verbose = false;
+static bool stats = false;
+static bool O0 = false, O1 = true, O2 = false;
+static int lockgeom = 1;
+static ErrorHandler errhandler;
+
+
+
+static int
+add_groupfile (int argc, const char *argv[])
+{
+    for (int i = 0;  i < argc;  i++)
+        groupfiles.push_back (argv[i]);
+    return 0;
+}
+
+
+
+static void
+getargs (int argc, const char *argv[])
+{
+    static bool help = false;
+    ArgParse ap;
+    ap.options ("Usage:  oslbake [options] groupfile...",
+                "%*", add_groupfile, "",
+                "--help", &help, "Print help message",
+                "-v", &verbose, "Verbose messages",
+                "--debug", &debug, "Lots of debugging info",
+                "--stats", &stats, "Print compile statistics",
+                "--cachedir %s", &cachedir, "JIT cache directory to fill (required)",
+                "--lockgeom %d", &lockgeom, "Lock geometric parameters (default: 1)",
+                "--raytypes %s", &raytypes, "Comma-separated list of the renderer's raytypes",
+                "-O0", &O0, "Do no runtime shader optimization",
+                "-O1", &O1, "Do a little runtime shader optimization",
+                "-O2", &O2, "Do lots of runtime shader optimization",
+                NULL);
+    if (ap.parse(argc, argv) < 0 || groupfiles.empty() || cachedir.empty()) {
+        std::cerr << ap.error_message() << std::endl;
+        ap.usage ();
+        exit (EXIT_FAILURE);
+    }
+    if (help) {
+        std::cout <<
+            "oslbake -- Compile Open Shading Language shader groups ahead of time\n"
+            "(c) Copyright 2009-2010 Sony Pictures Imageworks Inc. All Rights Reserved.\n";
+        ap.usage ();
+        exit (EXIT_SUCCESS);
+    }
+}
+
+
+
+/// Declare the shader group described by the words of one line of a
+/// group file.  Return false (after printing an error) if the line is
+/// malformed.
+static bool
+declare_group (const std::vector<std::string> &words,
+               const std::string &where)
+{
+    std::string layername;
+    shadingsys->ShaderGroupBegin ();
+    for (size_t i = 0;  i < words.size();  ++i) {
+        const std::string &w (words[i]);
+        size_t nargs = 0;
+        if (w == "--layer" || w == "--fparam" || w == "--iparam" ||
+              w == "--sparam")
+            nargs = (w == "--layer") ? 1 : 2;
+        else if (w == "--vparam" || w == "--connect")
+            nargs = 4;
+        if (i + nargs >= words.size() && nargs) {
+            std::cerr << where << ": " << w << " needs " << nargs
+                      << " arguments\n";
+            shadingsys->ShaderGroupEnd ();
+            return false;
+        }
+        const char *a = nargs ? words[i+1].c_str() : NULL;
+        if (w == "--layer") {
+            layername = words[i+1];
+        } else if (w == "--fparam") {
+            float f = (float) atof (words[i+2].c_str());
+            shadingsys->Parameter (a, TypeDesc::TypeFloat, &f);
+        } else if (w == "--iparam") {
+            int n = atoi (words[i+2].c_str());
+            shadingsys->Parameter (a, TypeDesc::TypeInt, &n);
+        } else if (w == "--vparam") {
+            float v[3];
+            for (int c = 0;  c < 3;  ++c)
+                v[c] = (float) atof (words[i+2+c].c_str());
+            shadingsys->Parameter (a, TypeDesc::TypeVector, v);
+        } else if (w == "--sparam") {
+            ustring s (words[i+2]);
+            shadingsys->Parameter (a, TypeDesc::TypeString, &s);
+        } else if (w == "--connect") {
+            shadingsys->ConnectShaders (a, words[i+2].c_str(),
+                                        words[i+3].c_str(),
+                                        words[i+4].c_str());
+        } else {
+            shadingsys->Shader ("surface", w.c_str(),
+                                layername.length() ? layername.c_str() : NULL);
+            layername.clear ();
+        }
+        i += nargs;
+    }
+    shadingsys->ShaderGroupEnd ();
+    return true;
+}
+
+
+
+int
+main (int argc, const char *argv[])
+{
+    Timer timer;
+    SimpleRenderer rend;
+    shadingsys = ShadingSystem::create (&rend, NULL, &errhandler);
+    getargs (argc, argv);
+
+    if (debug || verbose)
+        errhandler.verbosity (ErrorHandler::VERBOSE);
+
+    // These must match what the renderer will use, since they're part
+    // of every group's cache key.
+    shadingsys->attribute ("debug", (int)debug);
+    shadingsys->attribute ("optimize", O2 ? 2 : (O0 ? 0 : 1));
+    shadingsys->attribute ("lockgeom", lockgeom);
+    shadingsys->attribute ("cachedir", cachedir);
+    if (raytypes.size()) {
+        std::vector<std::string> names;
+        std::vector<const char *> ptrs;
+        std::istringstream in (raytypes);
+        std::string name;
+        while (std::getline (in, name, ','))
+            names.push_back (name);
+        for (size_t i = 0;  i < names.size();  ++i)
+            ptrs.push_back (names[i].c_str());
+        shadingsys->attribute ("raytypes",
+                               TypeDesc(TypeDesc::STRING, (int)ptrs.size()),
+                               &ptrs[0]);
+    }
+
+    int ngroups = 0, nbaked = 0, nfailed = 0;
+    for (size_t f = 0;  f < groupfiles.size();  ++f) {
+        std::ifstream in (groupfiles[f].c_str());
+        if (! in) {
+            std::cerr << "oslbake: could not open " << groupfiles[f] << "\n";
+            ++nfailed;
+            continue;
+        }
+        std::string line;
+        for (int lineno = 1;  std::getline (in, line);  ++lineno) {
+            std::vector<std::string> words;
+            std::istringstream linestream (line);
+            std::string w;
+            while (linestream >> w)
+                words.push_back (w);
+            if (words.empty() || words[0][0] == '#')
+                continue;
+            std::string where = Strutil::format ("%s:%d",
+                                                 groupfiles[f].c_str(), lineno);
+            ++ngroups;
+            ShadingAttribStateRef state;
+            if (declare_group (words, where))
+                state = shadingsys->state ();
+            if (state && shadingsys->bake (state)) {
+                ++nbaked;
+            } else {
+                std::cerr << where << ": shader group was not baked\n";
+                ++nfailed;
+            }
+            shadingsys->clear_state ();
+        }
+    }
+
+    if (verbose || stats)
+        std::cout << "Baked " << nbaked << " of " << ngroups
+                  << " shader groups to " << cachedir << " in "
+                  << Strutil::timeintervalformat (timer(), 2) << "\n";
+    if (debug || stats) {
+        std::cout << "\n";
+        std::cout << shadingsys->getstats (5) << "\n";
+    }
+
+    ShadingSystem::destroy (shadingsys);
+    return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -29,6 +29,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <cmath>
@@ -70,6 +71,9 @@ static int xres = 1, yres = 1;
 static std::string layername;
 static std::vector<std::string> connections;
 static std::vector<std::string> iparams, fparams, vparams, sparams;
+static std::vector<std::string> ifparams, isparams;
+static std::vector<std::string> refparams, resparams;
+static std::vector<std::string> udfparams, udiparams;
 static float fparamdata[1000];   // bet that's big enough
 static int fparamindex = 0;
 static int iparamdata[1000];
@@ -79,6 +83,33 @@ static int sparamindex = 0;
 static ErrorHandler errhandler;
 static int iters = 1;
 static std::string raytype = "camera";
+static bool batch = false;
+static bool grid = false;
+static std::string cachedir;
+static std::vector<std::string> statnames;
+static int raytype_variants = 0;
+static bool noderivs = false;
+static bool noderivs_variants = false;
+static std::string renderer_outputs;
+static std::vector<std::string> printvars;
+static int ngroups = 1;
+static bool memoize = false;
+static bool nodedup = false;
+static int optimize_threads = 0;
+static bool inline_layers = false;
+static bool clearmemory = false;
+static bool clearmemory_full = false;
+static int async = 0;
+static bool cancel_groups = false;
+
+/// What add_shader was asked to declare, so that --groups can declare
+/// the same layers again.
+struct LayerDecl {
+    std::string shadername, layername;
+    std::vector<std::string> iparams, fparams, vparams, sparams;
+    std::vector<std::string> ifparams, isparams;
+};
+static std::vector<LayerDecl> layerdecls;
 
 
 
@@ -111,6 +142,20 @@ inject_params ()
                                &sparamdata[sparamindex]);
         sparamindex += 1;
     }
+    for (size_t p = 0;  p < ifparams.size();  p += 2) {
+        fparamdata[fparamindex] = atof (ifparams[p+1].c_str());
+        shadingsys->InteractiveParameter (ifparams[p].c_str(),
+                                          TypeDesc::TypeFloat,
+                                          &fparamdata[fparamindex]);
+        fparamindex += 1;
+    }
+    for (size_t p = 0;  p < isparams.size();  p += 2) {
+        sparamdata[sparamindex] = ustring (isparams[p+1]);
+        shadingsys->InteractiveParameter (isparams[p].c_str(),
+                                          TypeDesc::TypeString,
+                                          &sparamdata[sparamindex]);
+        sparamindex += 1;
+    }
 }
 
 
@@ -121,8 +166,32 @@ add_shader (int argc, const char *argv[])
     shadingsys->attribute ("debug", (int)debug);
     shadingsys->attribute ("optimize", O2 ? 2 : (O0 ? 0 : 1));
     shadingsys->attribute ("lockgeom", 1);
+    if (renderer_outputs.size()) {
+        std::vector<std::string> names;
+        std::vector<const char *> ptrs;
+        std::istringstream in (renderer_outputs);
+        std::string name;
+        while (std::getline (in, name, ','))
+            names.push_back (name);
+        for (size_t i = 0;  i < names.size();  ++i)
+            ptrs.push_back (names[i].c_str());
+        shadingsys->attribute ("renderer_outputs",
+                               TypeDesc(TypeDesc::STRING, (int)ptrs.size()),
+                               &ptrs[0]);
+    }
 
     for (int i = 0;  i < argc;  i++) {
+        LayerDecl decl;
+        decl.shadername = argv[i];
+        decl.layername = layername;
+        decl.iparams = iparams;
+        decl.fparams = fparams;
+        decl.vparams = vparams;
+        decl.sparams = sparams;
+        decl.ifparams = ifparams;
+        decl.isparams = isparams;
+        layerdecls.push_back (decl);
+
         inject_params ();
 
         shadernames.push_back (argv[i]);
@@ -134,6 +203,8 @@ add_shader (int argc, const char *argv[])
         fparams.clear ();
         vparams.clear ();
         sparams.clear ();
+        ifparams.clear ();
+        isparams.clear ();
     }
     return 0;
 }
@@ -169,11 +240,56 @@ getargs (int argc, const char *argv[])
                 "--sparam %L %L",
                         &sparams, &sparams,
                         "Add a string param (args: name value)",
+                "--ifparam %L %L",
+                        &ifparams, &ifparams,
+                        "Add an interactive float param (args: name value)",
+                "--isparam %L %L",
+                        &isparams, &isparams,
+                        "Add an interactive string param (args: name value)",
+                "--refparam %L %L %L",
+                        &refparams, &refparams, &refparams,
+                        "Shade again with a new interactive float value (args: layer name value)",
+                "--resparam %L %L %L",
+                        &resparams, &resparams, &resparams,
+                        "Shade again with a new interactive string value (args: layer name value)",
+                "--udfparam %L %L",
+                        &udfparams, &udfparams,
+                        "Add a float constant userdata (args: name value)",
+                "--udiparam %L %L",
+                        &udiparams, &udiparams,
+                        "Add an integer constant userdata (args: name value)",
                 "--connect %L %L %L %L",
                     &connections, &connections, &connections, &connections,
                     "Connect fromlayer fromoutput tolayer toinput",
                 "--raytype %s", &raytype, "Set the raytype",
+                "--raytype_variants %d", &raytype_variants,
+                        "Max number of per-raytype variants of the group",
+                "--noderivs", &noderivs, "Shade without derivatives",
+                "--noderivs_variants", &noderivs_variants,
+                        "Make a no-derivatives variant of the group",
                 "--iters %d", &iters, "Number of iterations",
+                "--batch", &batch, "Shade all the points with one execute_batch call",
+                "--grid", &grid, "Bind all the points as a grid, then execute it",
+                "--cachedir %s", &cachedir, "Use (and fill) this JIT cache directory",
+                "--stat %L", &statnames, "Print the named statistic after shading",
+                "--print %L", &printvars, "Print the value of a variable at each point",
+                "--renderer_outputs %s", &renderer_outputs,
+                        "Comma-separated list of the outputs the renderer needs",
+                "--groups %d", &ngroups, "Declare and shade this many copies of the group",
+                "--memoize", &memoize, "Reuse specialized instances across groups",
+                "--nodedup", &nodedup, "Don't share the code of identical groups",
+                "--optimize_threads %d", &optimize_threads,
+                        "Split the cleanup of the group's layers among this many threads",
+                "--inline_layers", &inline_layers,
+                        "Inline layers run from just one place into their callers",
+                "--clearmemory", &clearmemory,
+                        "Zero the shading data before running the shaders",
+                "--clearmemory_full", &clearmemory_full,
+                        "With --clearmemory, zero all of it rather than just what needs it",
+                "--async %d", &async,
+                        "Compile groups in the background with this many threads",
+                "--cancel_groups", &cancel_groups,
+                        "With --async, drop the --groups copies while they compile",
                 "-O0", &O0, "Do no runtime shader optimization",
                 "-O1", &O1, "Do a little runtime shader optimization",
                 "-O2", &O2, "Do lots of runtime shader optimization",
@@ -195,6 +311,292 @@ getargs (int argc, const char *argv[])
 
 
 
+/// Make the --connect connections of the group being declared.
+static void
+connect_layers (bool announce)
+{
+    for (size_t i = 0;  i < connections.size();  i += 4) {
+        if (i+3 < connections.size()) {
+            if (announce)
+                std::cout << "Connect " 
+                          << connections[i] << "." << connections[i+1]
+                          << " to " << connections[i+2] << "." << connections[i+3]
+                          << "\n";
+            shadingsys->ConnectShaders (connections[i].c_str(),
+                                        connections[i+1].c_str(),
+                                        connections[i+2].c_str(),
+                                        connections[i+3].c_str());
+        }
+    }
+}
+
+
+
+/// Give the attribute state being declared the --udfparam and
+/// --udiparam constant userdata.
+static void
+declare_userdata ()
+{
+    for (size_t p = 0;  p < udfparams.size();  p += 2) {
+        float f = atof (udfparams[p+1].c_str());
+        shadingsys->ConstantUserdata (udfparams[p].c_str(),
+                                      TypeDesc::TypeFloat, &f);
+    }
+    for (size_t p = 0;  p < udiparams.size();  p += 2) {
+        int i = atoi (udiparams[p+1].c_str());
+        shadingsys->ConstantUserdata (udiparams[p].c_str(),
+                                      TypeDesc::TypeInt, &i);
+    }
+}
+
+
+
+/// Declare another group with the same layers, parameters, connections
+/// and userdata as the one on the command line, and return its state.
+static ShadingAttribStateRef
+declare_group_copy ()
+{
+    shadingsys->clear_state ();
+    shadingsys->ShaderGroupBegin ();
+    for (size_t i = 0;  i < layerdecls.size();  ++i) {
+        const LayerDecl &decl (layerdecls[i]);
+        iparams = decl.iparams;
+        fparams = decl.fparams;
+        vparams = decl.vparams;
+        sparams = decl.sparams;
+        ifparams = decl.ifparams;
+        isparams = decl.isparams;
+        inject_params ();
+        const char *layer = decl.layername.length() ? decl.layername.c_str()
+                                                    : NULL;
+        shadingsys->Shader ("surface", decl.shadername.c_str(), layer);
+    }
+    iparams.clear ();
+    fparams.clear ();
+    vparams.clear ();
+    sparams.clear ();
+    ifparams.clear ();
+    isparams.clear ();
+    connect_layers (false);
+    shadingsys->ShaderGroupEnd ();
+    declare_userdata ();
+    return shadingsys->state ();
+}
+
+
+
+/// Print the statistics requested with --stat, one per line.
+static void
+print_stats ()
+{
+    for (size_t i = 0;  i < statnames.size();  ++i) {
+        const std::string &name (statnames[i]);
+        int ival;
+        long long llval;
+        float fval;
+        if (shadingsys->getattribute (name, TypeDesc::INT, &ival))
+            std::cout << name << " = " << ival << "\n";
+        else if (shadingsys->getattribute (name, TypeDesc::INT64, &llval))
+            std::cout << name << " = " << llval << "\n";
+        else if (shadingsys->getattribute (name, TypeDesc::FLOAT, &fval))
+            std::cout << name << " = " << fval << "\n";
+        else
+            std::cout << "Unknown statistic " << name << "\n";
+    }
+}
+
+
+
+/// Set the globals that differ for point (x,y) of the grid.
+static void
+setup_point (ShaderGlobals &sg, int x, int y)
+{
+    sg.u = (xres == 1) ? 0.5f : (float) x / (xres - 1);
+    sg.v = (yres == 1) ? 0.5f : (float) y / (yres - 1);
+    sg.P = Vec3 (sg.u, sg.v, 1.0f);
+    sg.dPdx = Vec3 (sg.dudx, sg.dudy, 0.0f);
+    sg.dPdy = Vec3 (sg.dvdx, sg.dvdy, 0.0f);
+    sg.N    = Vec3 (0, 0, 1);
+    sg.Ng   = Vec3 (0, 0, 1);
+    sg.dPdu = Vec3 (1.0f, 0.0f, 0.0f);
+    sg.dPdv = Vec3 (0.0f, 1.0f, 0.0f);
+    sg.surfacearea = 1;
+}
+
+
+
+/// Print the values of the --print variables of a point, whose values
+/// are those of gridpoint in the context's heap.
+static void
+print_vars (ShadingContext *ctx, int gridpoint)
+{
+    std::vector<float> vals;
+    for (size_t i = 0;  i < printvars.size();  ++i) {
+        Symbol *sym = ctx->symbol (ShadUseSurface, ustring(printvars[i]));
+        if (! sym) {
+            std::cout << printvars[i] << " not found\n";
+            continue;
+        }
+        TypeDesc t = sym->typespec().simpletype();
+        if (t.basetype != TypeDesc::FLOAT && t.basetype != TypeDesc::INT) {
+            std::cout << printvars[i] << " is not numeric\n";
+            continue;
+        }
+        int n = t.numelements() * t.aggregate;
+        vals.resize (n);
+        OIIO::convert_types (TypeDesc ((TypeDesc::BASETYPE)t.basetype),
+                             ctx->symbol_data (*sym, gridpoint),
+                             TypeDesc::FLOAT, &vals[0], n);
+        std::cout << printvars[i] << " =";
+        for (int c = 0;  c < n;  ++c)
+            std::cout << " " << vals[c];
+        std::cout << "\n";
+    }
+}
+
+
+
+/// Extract the output vars of the n-th point, (x,y), into the output
+/// images.  Its values are those of gridpoint in the context's heap.
+static void
+save_outputs (ShadingContext *ctx, int x, int y, int n, int gridpoint)
+{
+    std::vector<float> pixel;
+    for (size_t i = 0;  i < outputfiles.size();  ++i) {
+        Symbol *sym = ctx->symbol (ShadUseSurface, ustring(outputvars[i]));
+        if (! sym) {
+            if (n == 0) {
+                std::cout << "Output " << outputvars[i] << " not found, skipping.\n";
+                outputimgs.push_back(0); // invalid image
+            }
+            continue;
+        }
+        if (n == 0)
+            std::cout << "Output " << outputvars[i] << " to " << outputfiles[i]<< "\n";
+        TypeDesc t = sym->typespec().simpletype();
+        TypeDesc tbase = TypeDesc ((TypeDesc::BASETYPE)t.basetype);
+        TypeDesc outtypebase = tbase;
+        if (dataformatname == "uint8")
+            outtypebase = TypeDesc::UINT8;
+        else if (dataformatname == "half")
+            outtypebase = TypeDesc::HALF;
+        else if (dataformatname == "float")
+            outtypebase = TypeDesc::FLOAT;
+        int nchans = t.numelements() * t.aggregate;
+        pixel.resize (nchans);
+        if (n == 0) {
+            OIIO::ImageSpec spec (xres, yres, nchans, outtypebase);
+            OIIO::ImageBuf* img = new OIIO::ImageBuf(outputfiles[i], spec);
+#if OPENIMAGEIO_VERSION >= 900 /* 0.9.0 */
+            OIIO::ImageBufAlgo::zero (*img);
+#else
+            img->zero ();
+#endif
+            outputimgs.push_back(img);
+        }
+        OIIO::convert_types (tbase, ctx->symbol_data (*sym, gridpoint),
+                             TypeDesc::FLOAT, &pixel[0], nchans);
+        outputimgs[i]->setpixel (x, y, &pixel[0]);
+    }
+}
+
+
+
+/// Shade every point of the grid with the group of shaderstate, and
+/// return the time spent running it.  If save is true, print the --print
+/// variables of each point, and if saveimages is also true, extract its
+/// outputs into the output images.
+static double
+shade_group (ShadingAttribState &shaderstate,
+             std::vector<ShaderGlobals> &gridglobals, void *thread_info,
+             bool save, bool saveimages)
+{
+    ShadingSystemImpl *ssi = (ShadingSystemImpl *)shadingsys;
+    int npoints = (int) gridglobals.size();
+    double runtime = 0;
+    Timer timer;
+    if (batch || grid) {
+        // Shade the whole grid at once
+        ShadingContext *ctx = ssi->get_context (thread_info);
+        timer.reset ();
+        timer.start ();
+        for (int tries = 0;  tries < 2;  ++tries) {
+            if (grid) {
+                if (ctx->bind (ShadUseSurface, shaderstate,
+                               &gridglobals[0], npoints, ! noderivs))
+                    ctx->execute (ShadUseSurface);
+            } else {
+                ctx->execute_batch (ShadUseSurface, shaderstate,
+                                    &gridglobals[0], npoints, ! noderivs);
+            }
+            // With --async, the group may still be being compiled in
+            // the background; wait for it and shade the grid again.
+            if (! ctx->compile_pending ())
+                break;
+            ssi->wait_for_compiles ();
+        }
+        runtime += timer ();
+        for (int n = 0;  save && n < npoints;  ++n) {
+            print_vars (ctx, n);
+            if (saveimages)
+                save_outputs (ctx, n % xres, n / xres, n, n);
+        }
+        ssi->release_context (ctx, thread_info);
+        return runtime;
+    }
+    for (int n = 0;  n < npoints;  ++n) {
+        // Request a shading context, bind it, execute the shaders.
+        // FIXME -- this will eventually be replaced with a public
+        // ShadingSystem call that encapsulates it.
+        ShadingContext *ctx = ssi->get_context (thread_info);
+        timer.reset ();
+        timer.start ();
+        // run shader for this point
+        ctx->execute (ShadUseSurface, shaderstate, gridglobals[n],
+                      ! noderivs);
+        if (ctx->compile_pending ()) {
+            // With --async, the group may still be being compiled in the
+            // background.  Defer the point until it's done (this being a
+            // test, by waiting, so the rest are still shaded in order),
+            // then shade it again.
+            ssi->wait_for_compiles ();
+            ctx->execute (ShadUseSurface, shaderstate, gridglobals[n],
+                          ! noderivs);
+        }
+        runtime += timer ();
+        if (save) {
+            print_vars (ctx, 0);
+            if (saveimages)
+                save_outputs (ctx, n % xres, n / xres, n, 0);
+        }
+        ssi->release_context (ctx, thread_info);
+    }
+    return runtime;
+}
+
+
+
+/// Give the --refparam and --resparam interactive params of the group
+/// of shaderstate their new values.
+static void
+reparameterize (ShadingAttribStateRef &shaderstate)
+{
+    for (size_t p = 0;  p < refparams.size();  p += 3) {
+        float f = atof (refparams[p+2].c_str());
+        shadingsys->ReParameter (shaderstate, refparams[p].c_str(),
+                                 refparams[p+1].c_str(),
+                                 TypeDesc::TypeFloat, &f);
+    }
+    for (size_t p = 0;  p < resparams.size();  p += 3) {
+        const char *str = resparams[p+2].c_str();
+        shadingsys->ReParameter (shaderstate, resparams[p].c_str(),
+                                 resparams[p+1].c_str(),
+                                 TypeDesc::TypeString, &str);
+    }
+}
+
+
+
 int
 main (int argc, const char *argv[])
 {
@@ -206,28 +608,34 @@ main (int argc, const char *argv[])
 
     shadingsys->ShaderGroupBegin ();
     getargs (argc, argv);
+    if (cachedir.size())
+        shadingsys->attribute ("cachedir", cachedir);
+    shadingsys->attribute ("raytype_variants", raytype_variants);
+    shadingsys->attribute ("noderivs_variants", (int)noderivs_variants);
+    shadingsys->attribute ("memoize_instances", (int)memoize);
+    if (nodedup)
+        shadingsys->attribute ("dedup_groups", 0);
+    shadingsys->attribute ("optimize_threads", optimize_threads);
+    shadingsys->attribute ("inline_layers", (int)inline_layers);
+    shadingsys->attribute ("clearmemory", (int)clearmemory);
+    shadingsys->attribute ("clearmemory_partial", (int)!clearmemory_full);
+    shadingsys->attribute ("async_compile", async);
 
     if (debug || verbose)
         errhandler.verbosity (ErrorHandler::VERBOSE);
 
-    for (size_t i = 0;  i < connections.size();  i += 4) {
-        if (i+3 < connections.size()) {
-            std::cout << "Connect " 
-                      << connections[i] << "." << connections[i+1]
-                      << " to " << connections[i+2] << "." << connections[i+3]
-                      << "\n";
-            shadingsys->ConnectShaders (connections[i].c_str(),
-                                        connections[i+1].c_str(),
-                                        connections[i+2].c_str(),
-                                        connections[i+3].c_str());
-        }
-    }
+    connect_layers (true);
 
     shadingsys->ShaderGroupEnd ();
+    declare_userdata ();
 
     // getargs called 'add_shader' for each shader mentioned on the command
-    // line.  So now we should have a valid shading state.
-    ShadingAttribStateRef shaderstate = shadingsys->state ();
+    // line.  So now we should have a valid shading state.  Any copies
+    // of the group are shaded after it, in turn.
+    std::vector<ShadingAttribStateRef> shaderstates;
+    shaderstates.push_back (shadingsys->state ());
+    for (int g = 1;  g < ngroups;  ++g)
+        shaderstates.push_back (declare_group_copy ());
 
     // Set up shader globals and a little test grid of points to shade.
     ShaderGlobals shaderglobals;
@@ -257,86 +665,58 @@ main (int argc, const char *argv[])
     // std::cout << "myspace-to-common matrix: " << Mmyspace << "\n";
     rend.name_transform ("myspace", Mmyspace);
 
-    shaderglobals.dudx = 1.0f / xres;
-    shaderglobals.dvdy = 1.0f / yres;
+    // Without derivatives, they're all taken to be zero
+    shaderglobals.dudx = noderivs ? 0.0f : 1.0f / xres;
+    shaderglobals.dvdy = noderivs ? 0.0f : 1.0f / yres;
 
     shaderglobals.raytype = ((ShadingSystemImpl *)shadingsys)->raytype_bit (ustring(raytype));
 
     double setuptime = timer ();
     double runtime = 0;
 
-    std::vector<float> pixel;
-
     if (outputfiles.size() != 0)
         std::cout << "\n";
 
+    // The globals of every point of the grid
+    int npoints = xres * yres;
+    std::vector<ShaderGlobals> gridglobals (npoints, shaderglobals);
+    for (int y = 0, n = 0;  y < yres;  ++y)
+        for (int x = 0;  x < xres;  ++x, ++n)
+            setup_point (gridglobals[n], x, y);
+
     // grab this once since we will be shading several points
     ShadingSystemImpl *ssi = (ShadingSystemImpl *)shadingsys;
     void* thread_info = ssi->create_thread_info();
-    for (int iter = 0;  iter < iters;  ++iter) {
-        for (int y = 0, n = 0;  y < yres;  ++y) {
-            for (int x = 0;  x < xres;  ++x, ++n) {
-                shaderglobals.u = (xres == 1) ? 0.5f : (float) x / (xres - 1);
-                shaderglobals.v = (yres == 1) ? 0.5f : (float) y / (yres - 1);
-                shaderglobals.P = Vec3 (shaderglobals.u, shaderglobals.v, 1.0f);
-                shaderglobals.dPdx = Vec3 (shaderglobals.dudx, shaderglobals.dudy, 0.0f);
-                shaderglobals.dPdy = Vec3 (shaderglobals.dvdx, shaderglobals.dvdy, 0.0f);
-                shaderglobals.N    = Vec3 (0, 0, 1);
-                shaderglobals.Ng   = Vec3 (0, 0, 1);
-                shaderglobals.dPdu = Vec3 (1.0f, 0.0f, 0.0f);
-                shaderglobals.dPdv = Vec3 (0.0f, 1.0f, 0.0f);
-                shaderglobals.surfacearea = 1;
-
-                // Request a shading context, bind it, execute the shaders.
-                // FIXME -- this will eventually be replaced with a public
-                // ShadingSystem call that encapsulates it.
-                ShadingContext *ctx = ssi->get_context (thread_info);
-                timer.reset ();
-                timer.start ();
-                // run shader for this point
-                ctx->execute (ShadUseSurface, *shaderstate, shaderglobals);
-                runtime += timer ();
-
-                if (iter == (iters - 1)) {
-                   // extract any output vars into images (on last iteration only)
-                   for (size_t i = 0;  i < outputfiles.size();  ++i) {
-                       Symbol *sym = ctx->symbol (ShadUseSurface, ustring(outputvars[i]));
-                       if (! sym) {
-                           if (n == 0) {
-                              std::cout << "Output " << outputvars[i] << " not found, skipping.\n";
-                              outputimgs.push_back(0); // invalid image
-                           }
-                           continue;
-                       }
-                       if (n == 0)
-                           std::cout << "Output " << outputvars[i] << " to " << outputfiles[i]<< "\n";
-                       TypeDesc t = sym->typespec().simpletype();
-                       TypeDesc tbase = TypeDesc ((TypeDesc::BASETYPE)t.basetype);
-                       TypeDesc outtypebase = tbase;
-                       if (dataformatname == "uint8")
-                           outtypebase = TypeDesc::UINT8;
-                       else if (dataformatname == "half")
-                           outtypebase = TypeDesc::HALF;
-                       else if (dataformatname == "float")
-                           outtypebase = TypeDesc::FLOAT;
-                       int nchans = t.numelements() * t.aggregate;
-                       pixel.resize (nchans);
-                       if (n == 0) {
-                           OIIO::ImageSpec spec (xres, yres, nchans, outtypebase);
-                           OIIO::ImageBuf* img = new OIIO::ImageBuf(outputfiles[i], spec);
-#if OPENIMAGEIO_VERSION >= 900 /* 0.9.0 */
-                           OIIO::ImageBufAlgo::zero (*img);
-#else
-                           img->zero ();
-#endif
-                           outputimgs.push_back(img);
-                       }
-                       OIIO::convert_types (tbase, ctx->symbol_data (*sym, 0),
-                                                   TypeDesc::FLOAT, &pixel[0], nchans);
-                       outputimgs[i]->setpixel (x, y, &pixel[0]);
-                   }
-                }
-                ssi->release_context (ctx, thread_info);
+    if (async && cancel_groups) {
+        // Queue the compiles of the copies of the group, then drop the
+        // copies while their compiles are still queued or running, which
+        // must cancel them.  Just the first group is shaded after that.
+        for (size_t g = 1;  g < shaderstates.size();  ++g) {
+            ShadingContext *ctx = ssi->get_context (thread_info);
+            ctx->execute (ShadUseSurface, *shaderstates[g], gridglobals[0],
+                          ! noderivs);
+            ssi->release_context (ctx, thread_info);
+        }
+        shadingsys->clear_state ();   // it holds the last copy's state
+        shaderstates.resize (1);
+    }
+    // If any interactive params are to be changed, shade everything
+    // again afterwards, with the new values.
+    int npasses = (refparams.size() || resparams.size()) ? 2 : 1;
+    for (int pass = 0;  pass < npasses;  ++pass) {
+        if (pass > 0) {
+            for (size_t g = 0;  g < shaderstates.size();  ++g)
+                reparameterize (shaderstates[g]);
+        }
+        for (int iter = 0;  iter < iters;  ++iter) {
+            // Outputs are extracted on the last iteration only (and
+            // saved to the images for the first group of the last
+            // pass only)
+            bool save = (iter == (iters - 1));
+            for (size_t g = 0;  g < shaderstates.size();  ++g) {
+                bool saveimages = (save && g == 0 && pass == npasses-1);
+                runtime += shade_group (*shaderstates[g], gridglobals,
+                                        thread_info, save, saveimages);
             }
         }
     }
@@ -344,6 +724,7 @@ main (int argc, const char *argv[])
 
     if (outputfiles.size() == 0)
         std::cout << "\n";
+    print_stats ();
 
     // write any images to disk
     for (size_t i = 0;  i < outputimgs.size();  ++i) {
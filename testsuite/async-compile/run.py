@@ -0,0 +1,33 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: compile the group in the background, shading the
+# points that were deferred while it compiled once it's done.  Then
+# declare copies of the group and drop them while their compiles are
+# still queued or running, which must cancel those compiles and leave
+# the first group to be compiled and shaded as usual.
+testshade = path + "testshade/testshade -g 2 2 --print f_out "
+command = path + "oslc/oslc test.osl > out.txt"
+command = command + "; " + testshade + "--async 2 --stat stat:async_compiles test >> out.txt"
+command = command + "; " + testshade + "--async 1 --groups 3 --cancel_groups test >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
@@ -0,0 +1,35 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: with "clearmemory", query the output of a lazy layer
+# that runs only for some points.  Each point reuses the shading context
+# of the one before, so where the layer doesn't run, its output must have
+# been cleared of the previous point's value.  Zeroing just the data that
+# needs it must give the same values as having the context zero it all.
+layers = "--layer alayer a --layer blayer b --connect alayer a_out blayer b_in"
+testshade = path + "testshade/testshade -g 2 2 -O2 --clearmemory --print a_out " + layers
+command = path + "oslc/oslc a.osl > out.txt"
+command = command + "; " + path + "oslc/oslc b.osl >> out.txt"
+command = command + "; " + testshade + " >> out.txt"
+command = command + "; " + testshade + " --clearmemory_full >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
@@ -0,0 +1,32 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: userdata that is constant for the attribute state
+# is folded into the params that would otherwise get it from the
+# renderer (which in testshade has none, so they keep their defaults),
+# but not into params with lockgeom.
+testshade = path + "testshade/testshade -g 2 2 -O2 --stat stat:userdata_groups --stat stat:userdata_params"
+command = path + "oslc/oslc test.osl > out.txt"
+command = command + "; " + testshade + " test >> out.txt"
+command = command + "; " + testshade + " --udfparam Kd 0.25 --udiparam n 3 --udfparam Ks 2 test >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
@@ -0,0 +1,29 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: -O2 reuses common subexpressions, which must not
+# change the results
+command = path + "oslc/oslc test.osl > out.txt"
+command = command + "; " + path + "testshade/testshade -g 2 2 -O1 test >> out.txt"
+command = command + "; " + path + "testshade/testshade -g 2 2 -O2 test >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
@@ -0,0 +1,30 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run
+command = path + "oslc/oslc a.osl > out.txt"
+command = command + "; " + path + "oslc/oslc b.osl >> out.txt"
+layers = "--layer alayer a --layer blayer b --connect alayer f_out blayer f_in --connect alayer c_out blayer c_in"
+command = command + "; " + path + "testshade/testshade -g 2 2 " + layers + " >> out.txt"
+command = command + "; " + path + "testshade/testshade -g 2 2 --grid " + layers + " >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
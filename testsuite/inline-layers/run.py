@@ -0,0 +1,37 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: shade a group of lazy layers without and then with
+# "inline_layers".  Layer a is run from two places (b and d), so it stays
+# a separate function; b and c are run from one place each, so they're
+# inlined into d.  Either way, each layer must run exactly when it did
+# before: a just once per point, and c only where d needs it.
+layers = "--layer alayer a --layer blayer b --layer clayer c --layer dlayer d --connect alayer f_out blayer f_in --connect alayer f_out dlayer a_in --connect blayer f_out dlayer b_in --connect clayer f_out dlayer c_in"
+testshade = path + "testshade/testshade -g 2 2 -O2 " + layers
+command = path + "oslc/oslc a.osl > out.txt"
+command = command + "; " + path + "oslc/oslc b.osl >> out.txt"
+command = command + "; " + path + "oslc/oslc c.osl >> out.txt"
+command = command + "; " + path + "oslc/oslc d.osl >> out.txt"
+command = command + "; " + testshade + " >> out.txt"
+command = command + "; " + testshade + " --inline_layers >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
@@ -0,0 +1,32 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: compile the group into an empty cache, then run
+# again, loading it from the cache, which must give the same results.
+stats = "--stat stat:jitcache_hits --stat stat:jitcache_misses --stat stat:jitcache_stores"
+command = "rm -rf cache; mkdir cache"
+command = command + "; " + path + "oslc/oslc test.osl > out.txt"
+command = command + "; " + path + "testshade/testshade -g 2 2 --cachedir cache " + stats + " test >> out.txt"
+command = command + "; " + path + "testshade/testshade -g 2 2 --cachedir cache " + stats + " test >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+os.system ("rm -rf cache")
+sys.exit (ret)
@@ -0,0 +1,34 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: shade two copies of a group (which aren't allowed
+# to share their code outright), first specializing each layer of each
+# one, then reusing the specializations of the first group in the
+# second, which must give the same results.
+layers = "--layer alayer --fparam Kd 0.25 a --layer blayer b --connect alayer f_out blayer f_in"
+testshade = path + "testshade/testshade -g 2 2 -O2 --groups 2 --nodedup --stat stat:instance_memo_hits --stat stat:instance_memo_misses"
+command = path + "oslc/oslc a.osl > out.txt"
+command = command + "; " + path + "oslc/oslc b.osl >> out.txt"
+command = command + "; " + testshade + " " + layers + " >> out.txt"
+command = command + "; " + testshade + " --memoize " + layers + " >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
@@ -0,0 +1,42 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: an eight-layer group, whose layers are finished
+# serially and then split between two threads.  The results must be the
+# same, and so must the symbols and ops left after optimizing.  Rather
+# than pin those counts down in the reference (they'd change with every
+# tweak to the optimizer), the two runs' counts are compared with each
+# other, and any difference ends up in the output.
+layers = "--layer s0 stage --layer s1 stage --layer s2 stage --layer s3 stage --layer s4 stage --layer s5 stage --layer s6 stage --layer out final"
+for i in range (6) :
+    layers = layers + " --connect s" + str(i) + " f_out s" + str(i+1) + " f_in"
+layers = layers + " --connect s6 f_out out f_in"
+testshade = path + "testshade/testshade -g 2 2 -O2 " + layers
+stats = " --stat stat:preopt_syms --stat stat:postopt_syms --stat stat:preopt_ops --stat stat:postopt_ops"
+command = path + "oslc/oslc stage.osl > out.txt"
+command = command + "; " + path + "oslc/oslc final.osl >> out.txt"
+command = command + "; " + testshade + " --optimize_threads 2 >> out.txt"
+command = command + "; " + testshade + stats + " --optimize_threads 0 > serial.txt"
+command = command + "; " + testshade + stats + " --optimize_threads 2 > threaded.txt"
+command = command + "; diff serial.txt threaded.txt >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ "serial.txt", "threaded.txt" ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
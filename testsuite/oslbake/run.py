@@ -0,0 +1,36 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: bake the group into an empty cache with oslbake,
+# then check that testshade loads it rather than compiling it, and that
+# it gives the same results as a group compiled on the spot.
+layers = "--layer alayer --fparam Kd 0.25 a --layer blayer b --connect alayer f_out blayer f_in"
+stats = "--stat stat:jitcache_hits --stat stat:jitcache_misses"
+command = "rm -rf cache; mkdir cache"
+command = command + "; " + path + "oslc/oslc a.osl > out.txt"
+command = command + "; " + path + "oslc/oslc b.osl >> out.txt"
+command = command + "; " + path + "oslbake/oslbake --cachedir cache groups.txt >> out.txt"
+command = command + "; " + path + "testshade/testshade -g 2 2 " + layers + " >> out.txt"
+command = command + "; " + path + "testshade/testshade -g 2 2 --cachedir cache " + stats + " " + layers + " >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+os.system ("rm -rf cache")
+sys.exit (ret)
@@ -0,0 +1,31 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: the variant made for each raytype must give the
+# same results as the generic group
+command = path + "oslc/oslc test.osl > out.txt"
+testshade = path + "testshade/testshade -g 2 2 -O2 --stat stat:group_variants"
+for r in [ "glossy", "camera" ] :
+    command = command + "; " + testshade + " --raytype " + r + " test >> out.txt"
+    command = command + "; " + testshade + " --raytype " + r + " --raytype_variants 1 test >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
@@ -0,0 +1,33 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: when the renderer lists the outputs it needs, an
+# output that isn't listed isn't computed (and keeps the zero it had in
+# the fresh heap), but one that a later layer reads still is.
+layers = "--layer alayer a --layer blayer b --connect alayer f_out blayer f_in"
+testshade = path + "testshade/testshade -g 2 2 -O2 --print g_out --print h_out"
+command = path + "oslc/oslc a.osl > out.txt"
+command = command + "; " + path + "oslc/oslc b.osl >> out.txt"
+command = command + "; " + testshade + " " + layers + " >> out.txt"
+command = command + "; " + testshade + " --renderer_outputs alayer.h_out " + layers + " >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
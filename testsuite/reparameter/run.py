@@ -0,0 +1,32 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# A command to run: shade with interactive params, change them with
+# ReParameter and shade again, which must give the same results as
+# params that had the new values all along, without compiling the
+# group again.
+testshade = path + "testshade/testshade -g 2 2 -O2 --layer lay"
+command = path + "oslc/oslc test.osl > out.txt"
+command = command + "; " + testshade + " --ifparam Kd 0.25 --isparam name first --refparam lay Kd 2 --resparam lay name second --stat stat:groups_compiled test >> out.txt"
+command = command + "; " + testshade + " --fparam Kd 2 --sparam name second test >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)